@@ -0,0 +1,265 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "abccache.h"
+#include "server.h"
+
+// Bump when the key or the entry layout changes.
+#define ABC_CACHE_FORMAT "1"
+
+static const char compiler_version[] = ABC_CACHE_FORMAT " " AVMPLUS_VERSION_USER " " AVMPLUS_BUILD_CODE;
+
+static const char     *cache_dir = NULL;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long   cache_hits = 0;
+static unsigned long   cache_misses = 0;
+static unsigned long   cache_uncached = 0;  // compile errors, includes, unwritable cache
+
+static void count( unsigned long *counter ) {
+    pthread_mutex_lock( &cache_lock );
+    (*counter)++;
+    pthread_mutex_unlock( &cache_lock );
+}
+
+static uint64_t fnv1a( uint64_t h, const void *p, size_t n ) {
+    const uint8_t *b = (const uint8_t *)p;
+    while ( n-- ) {
+        h ^= *b++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static bool is_source( const char *filename ) {
+    size_t len = strlen( filename );
+    return len > 3 && strcmp( filename + len - 3, ".as" ) == 0;
+}
+
+// Maps a source file read-only; NULL if it is missing or empty.
+static const uint8_t *map_source( const char *filename, size_t *len ) {
+    int fd = open( filename, O_RDONLY );
+    struct stat st;
+    if ( fd < 0 || fstat( fd, &st ) < 0 || st.st_size == 0 ) {
+        if ( fd >= 0 )
+            close( fd );
+        return NULL;
+    }
+    void *map = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    close( fd );
+    if ( map == MAP_FAILED )
+        return NULL;
+    *len = st.st_size;
+    return (const uint8_t *)map;
+}
+
+// NUL-terminated UTF-16 copy of UTF-8 text (minus any BOM), for the
+// compiler.  Malformed sequences become U+FFFD.
+static wchar *utf8_to_utf16( const uint8_t *in, size_t len, uint32_t *outlen ) {
+    wchar *out = (wchar *)malloc( (len + 1) * sizeof(wchar) );
+    uint32_t n = 0;
+    size_t i = 0;
+
+    if ( len >= 3 && in[0] == 0xEF && in[1] == 0xBB && in[2] == 0xBF )
+        i = 3;
+
+    while ( i < len ) {
+        uint32_t c = in[i++];
+        if ( c >= 0x80 && c < 0xC0 ) {
+            out[n++] = 0xFFFD;
+            continue;
+        }
+        int extra = c < 0x80 ? 0 : c < 0xE0 ? 1 : c < 0xF0 ? 2 : 3;
+        if ( extra )
+            c &= 0x3F >> extra;
+        for ( ; extra > 0 && i < len && (in[i] & 0xC0) == 0x80; extra-- )
+            c = (c << 6) | (in[i++] & 0x3F);
+        if ( extra )
+            c = 0xFFFD;
+
+        if ( c >= 0x10000 ) {
+            c -= 0x10000;
+            out[n++] = wchar( 0xD800 + (c >> 10) );
+            out[n++] = wchar( 0xDC00 + (c & 0x3FF) );
+        }
+        else
+            out[n++] = wchar( c );
+    }
+
+    out[n] = 0;
+    *outlen = n;
+    return out;
+}
+
+// Compiles into a malloc'd buffer.  Errors longjmp back to compile_source,
+// which leaves it to evaluateFile on the original source to report them.
+class CacheHostContext : public RTC::HostContext
+{
+public:
+    CacheHostContext( AvmCore *core )
+        : RTC::HostContext( core )
+        , abc(NULL)
+        , abclen(0)
+    {
+    }
+
+    virtual uint8_t *obtainStorageForResult( uint32_t nbytes ) {
+        abc = (uint8_t *)malloc( nbytes );
+        abclen = nbytes;
+        return abc;
+    }
+
+    // The key only covers the top-level file, so anything that includes
+    // other files is not cached.
+    virtual const wchar *readFileForEval( const wchar *, const wchar *, uint32_t * ) {
+        longjmp( bail, 1 );
+        return NULL;
+    }
+
+    virtual void freeInput( const wchar *input ) {
+        free( (void *)input );
+    }
+
+    virtual void doubleToString( double d, char *buf, size_t bufsiz ) {
+        StUTF8String s( core->doubleToString( d ) );
+        strncpy( buf, s.c_str(), bufsiz );
+        buf[bufsiz - 1] = 0;
+    }
+
+    virtual bool stringToDouble( const char *s, double *d ) {
+        char *end;
+        *d = strtod( s, &end );
+        return *s && !*end;
+    }
+
+    virtual void throwInternalError( const char * ) {
+        longjmp( bail, 1 );
+    }
+
+    virtual void throwSyntaxError( const char * ) {
+        longjmp( bail, 1 );
+    }
+
+    jmp_buf   bail;
+    uint8_t  *abc;
+    uint32_t  abclen;
+};
+
+static bool compile_source( AvmCore *core, const char *filename, const uint8_t *src, size_t len,
+                            uint8_t **abc, uint32_t *abclen ) {
+    uint32_t srclen, namelen;
+    wchar *wsrc  = utf8_to_utf16( src, len, &srclen );
+    wchar *wname = utf8_to_utf16( (const uint8_t *)filename, strlen( filename ), &namelen );
+    CacheHostContext context( core );
+    RTC::Compiler *volatile compiler = NULL;
+    bool ok = false;
+
+    if ( setjmp( context.bail ) == 0 ) {
+        compiler = new RTC::Compiler( &context, wname, wsrc, srclen, true );
+        compiler->compile();
+        ok = context.abc != NULL;
+    }
+
+    delete compiler;
+    free( wsrc );
+    free( wname );
+
+    if ( !ok ) {
+        free( context.abc );
+        return false;
+    }
+    *abc = context.abc;
+    *abclen = context.abclen;
+    return true;
+}
+
+// Written under a temporary name and renamed into place, so concurrent
+// workers never see a partial entry.
+static bool store( const char *path, const uint8_t *abc, uint32_t abclen ) {
+    char tmp[PATH_MAX];
+    snprintf( tmp, sizeof(tmp), "%s/.tmp-XXXXXX", cache_dir );
+
+    int fd = mkstemp( tmp );
+    if ( fd < 0 )
+        return false;
+
+    bool ok = write_all( fd, (const char *)abc, abclen ) == 0;
+    ok = close( fd ) == 0 && ok;
+    if ( ok && rename( tmp, path ) == 0 )
+        return true;
+
+    unlink( tmp );
+    return false;
+}
+
+void abc_cache_init( const char *dir ) {
+    if ( mkdir( dir, 0777 ) < 0 && errno != EEXIST ) {
+        perror( dir );
+        exit(1);
+    }
+    cache_dir = dir;
+}
+
+bool abc_cache_lookup( AvmCore *core, const char *filename, char *path, size_t size ) {
+    if ( !cache_dir || !is_source( filename ) )
+        return false;
+
+    // map the source rather than read it: it is only hashed, and compiled on a miss.
+    size_t len;
+    const uint8_t *src = map_source( filename, &len );
+    if ( !src )
+        return false;   // evaluateFile reports it
+
+    uint64_t h = fnv1a( fnv1a( 14695981039346656037ULL, compiler_version, sizeof(compiler_version) ), src, len );
+    snprintf( path, size, "%s/%016llx-%lu.abc", cache_dir, (unsigned long long)h, (unsigned long)len );
+
+    bool found = access( path, R_OK ) == 0;
+    if ( found ) {
+        count( &cache_hits );
+    }
+    else {
+        uint8_t *abc;
+        uint32_t abclen;
+        if ( compile_source( core, filename, src, len, &abc, &abclen ) ) {
+            found = store( path, abc, abclen );
+            free( abc );
+        }
+        count( found ? &cache_misses : &cache_uncached );
+    }
+
+    munmap( (void *)src, len );
+    return found;
+}
+
+void abc_cache_report() {
+    if ( cache_dir )
+        fprintf( stderr, "abc cache: %lu hits, %lu misses, %lu uncached\n",
+                 cache_hits, cache_misses, cache_uncached );
+}
+
+bool abc_compile_file( AvmCore *core, const char *filename, uint8_t **abc, uint32_t *abclen ) {
+    if ( !is_source( filename ) )
+        return false;
+
+    size_t len;
+    const uint8_t *src = map_source( filename, &len );
+    if ( !src )
+        return false;
+
+    bool ok = compile_source( core, filename, src, len, abc, abclen );
+    munmap( (void *)src, len );
+    return ok;
+}
+
+bool abc_compile_string( AvmCore *core, const char *name, const char *src, size_t len,
+                         uint8_t **abc, uint32_t *abclen ) {
+    return compile_source( core, name, (const uint8_t *)src, len, abc, abclen );
+}
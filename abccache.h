@@ -0,0 +1,32 @@
+#ifndef assh_abccache_h
+#define assh_abccache_h
+
+#include "shell.h"
+
+// Content-addressed on-disk cache of compiled ActionScript source
+// (-abc-cache DIR).  An entry is keyed by a hash of the compiler version
+// and the source text, so an unchanged script is compiled once and every
+// later run loads the stored abc instead.
+
+void abc_cache_init( const char *dir );
+
+// If filename is .as source and the cache is on, stores the path of its
+// compiled abc in path, compiling and caching it first on a miss, and
+// returns true.  Returns false when the file should be run as it is.
+// Call with the core's GC entered.
+bool abc_cache_lookup( AvmCore *core, const char *filename, char *path, size_t size );
+
+// Compiles .as source to abc in a malloc'd buffer, without the cache.
+// Returns false, leaving the file to evaluateFile, if filename is not .as
+// or doesn't compile on its own (errors, includes).  Needs no setup() on
+// core; call with its GC entered.
+bool abc_compile_file( AvmCore *core, const char *filename, uint8_t **abc, uint32_t *abclen );
+
+// Likewise for source text in memory, e.g. from the REPL; name is what
+// the compiler reports it as.
+bool abc_compile_string( AvmCore *core, const char *name, const char *src, size_t len,
+                         uint8_t **abc, uint32_t *abclen );
+
+void abc_cache_report();
+
+#endif
@@ -0,0 +1,121 @@
+// asshc: run a script on an `assh -server` and relay its output and exit code.
+//
+//   asshc [-s socket] file        run file (read by the server)
+//   asshc [-s socket] -p file     send file's contents as an abc payload
+//   asshc [-s socket] -q          stop the server
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "server.h"
+
+static void usage() {
+    fprintf( stderr, "usage: asshc [-s socket] [-p] file\n"
+                     "       asshc [-s socket] -q\n" );
+    exit( 2 );
+}
+
+static int send_request( int fd, const char *file, int payload ) {
+    char header[PATH_MAX + 16];
+
+    if ( !payload ) {
+        char path[PATH_MAX];
+        if ( !realpath( file, path ) ) {
+            perror( file );
+            return -1;
+        }
+        int len = snprintf( header, sizeof(header), "RUN %s\n", path );
+        return write_all( fd, header, len );
+    }
+
+    FILE *f = fopen( file, "rb" );
+    struct stat st;
+    if ( !f || fstat( fileno( f ), &st ) < 0 ) {
+        perror( file );
+        return -1;
+    }
+
+    char *bytes = (char *)malloc( st.st_size ? st.st_size : 1 );
+    size_t count = fread( bytes, 1, st.st_size, f );
+    fclose( f );
+    if ( count != (size_t)st.st_size ) {
+        fprintf( stderr, "%s: short read\n", file );
+        free( bytes );
+        return -1;
+    }
+
+    int len = snprintf( header, sizeof(header), "ABC %lu\n", (unsigned long)count );
+    int r = write_all( fd, header, len ) < 0 ? -1 : write_all( fd, bytes, count );
+    free( bytes );
+    return r;
+}
+
+// Copy output frames to stdout until the exit frame; returns the exit code.
+static int relay( int fd ) {
+    char header[64];
+    char buf[65536];
+
+    while ( read_line( fd, header, sizeof(header) ) >= 0 ) {
+        if ( header[0] == 'X' )
+            return atoi( header + 2 );
+
+        if ( header[0] != 'O' )
+            break;
+
+        size_t count = strtoul( header + 2, NULL, 10 );
+        while ( count > 0 ) {
+            size_t n = count < sizeof(buf) ? count : sizeof(buf);
+            if ( read_all( fd, buf, n ) < 0 )
+                goto lost;
+            fwrite( buf, 1, n, stdout );
+            count -= n;
+        }
+    }
+
+lost:
+    fflush( stdout );
+    fprintf( stderr, "asshc: lost connection to server\n" );
+    return 1;
+}
+
+int main( int argc, char **argv ) {
+    const char *socket_path = ASSH_DEFAULT_SOCKET;
+    int payload = 0, quit = 0, c;
+
+    while ( (c = getopt( argc, argv, "s:pq" )) != -1 ) {
+        switch (c)
+        {
+            case 's': socket_path = optarg; break;
+            case 'p': payload = 1; break;
+            case 'q': quit = 1; break;
+            default:  usage();
+        }
+    }
+
+    if ( quit ? optind != argc : optind != argc - 1 )
+        usage();
+
+    int fd = server_connect( socket_path );
+    if ( fd < 0 )
+        return 1;
+
+    if ( quit ) {
+        int r = write_all( fd, "QUIT\n", 5 );
+        close( fd );
+        return r < 0 ? 1 : 0;
+    }
+
+    if ( send_request( fd, argv[optind], payload ) < 0 ) {
+        close( fd );
+        return 1;
+    }
+
+    int code = relay( fd );
+    fflush( stdout );
+    close( fd );
+    return code;
+}
@@ -0,0 +1,372 @@
+#include <sys/stat.h>
+
+#include "shell.h"
+#include "asshcore.h"
+#include "mapfile.h"
+
+namespace avmshell
+{
+    AsshCore::AsshCore(MMgc::GC* gc, ShellSettings& settings, bool mainthread)
+    : ShellCoreImpl(gc, settings, mainthread)
+    , reusePools(false)
+    , overBudget(false)
+    , gcstats(assh_settings.gcstats || settings.do_repl ? new GCStats(gc) : NULL)
+    , profiler(assh_settings.profile_path ? new Profiler(this, assh_settings.profile_hz) : NULL)
+    , samplePending(false)
+    , jitmap(assh_settings.perf_map ? new JitMap() : NULL)
+    , toplevel(NULL)
+    , pools(NULL)
+    , numPools(0)
+    , mappings(NULL)
+    , budget(NULL)
+    , scannedPools(NULL)
+    , scannedPool(NULL)
+    {
+    }
+    
+    AsshCore::~AsshCore()
+    {
+        delete profiler;
+        delete jitmap;
+        delete gcstats;
+        delete budget;
+        while (pools != NULL) {
+            CachedPool* p = pools;
+            pools = p->next;
+            delete p;
+        }
+        while (mappings != NULL) {
+            HeldMapping* m = mappings;
+            mappings = m->next;
+            unmap_file(m->file);
+            delete m;
+        }
+    }
+    
+    /* virtual */
+    avmplus::Toplevel* AsshCore::createToplevel(avmplus::AbcEnv* abcEnv)
+    {
+        avmplus::Toplevel* t = ShellCoreImpl::createToplevel(abcEnv);
+        // The first toplevel created during setup() is the shell's own.
+        if (toplevel == NULL)
+            toplevel = t;
+        return t;
+    }
+    
+    void AsshCore::setHeapBudget(size_t soft, size_t hard)
+    {
+        AvmAssert(budget == NULL);
+        if (soft != 0 || hard != 0)
+            budget = new HeapBudget(GetGC(), this, soft, hard);
+    }
+    
+    void AsshCore::beginEval()
+    {
+        if (gcstats != NULL)
+            gcstats->beginEval();
+        if (jitmap != NULL)
+            jitmap->begin();
+        if (profiler != NULL)
+            profiler->start();
+    }
+    
+    void AsshCore::endEval()
+    {
+        if (profiler != NULL)
+            profiler->stop();
+        if (jitmap != NULL)
+            scanJitted();
+        if (gcstats != NULL)
+            gcstats->endEval();
+    }
+    
+    // Hands the perf map the builtin and shell pools, and the pools parsed
+    // since the last call: new ones go on the front of livePools, so those
+    // are the nodes ahead of the one that was first last time.  The list
+    // only holds weak references, and a node whose pool has died may have
+    // been reused, hence the check on the pool as well.
+    void AsshCore::scanJitted()
+    {
+        jitmap->scan(builtinPool);
+        jitmap->scan(shellPool);
+        for (LivePoolNode* node = livePools; node != NULL; node = node->next) {
+            avmplus::PoolObject* pool = (avmplus::PoolObject*)node->pool->get();
+            if (node == scannedPools && pool == scannedPool)
+                break;
+            if (pool != NULL && pool != builtinPool && pool != shellPool)
+                jitmap->scan(pool);
+        }
+        scannedPools = livePools;
+        scannedPool = livePools != NULL ? (avmplus::PoolObject*)livePools->pool->get() : NULL;
+    }
+    
+    /* virtual */
+    void AsshCore::interrupt(avmplus::Toplevel* env, InterruptReason reason)
+    {
+        if (overBudget && reason == ExternalInterrupt)
+            env->throwError(avmplus::kOutOfMemoryError);
+        // The profiler's sampler raises ExternalInterrupt too, and its
+        // last one may land after the profiler has gone.
+        if (samplePending && reason == ExternalInterrupt) {
+            samplePending = false;
+            if (profiler != NULL)
+                profiler->sample();
+            return;
+        }
+        ShellCoreImpl::interrupt(env, reason);
+    }
+    
+    /* virtual */
+    void AsshCore::HeapBudget::postsweep()
+    {
+        if (soft != 0 && GetGC()->GetBytesInUse() > soft)
+            exceeded();
+    }
+    
+    /* virtual */
+    void AsshCore::HeapBudget::stopGCActivity()
+    {
+        if (hard != 0 && GetGC()->GetBytesInUse() > hard)
+            exceeded();
+    }
+    
+    // Raised again at every check while the core is over, in case the
+    // script catches the error and carries on allocating.
+    void AsshCore::HeapBudget::exceeded()
+    {
+        core->overBudget = true;
+        core->raiseInterrupt(ExternalInterrupt);
+    }
+    
+    int AsshCore::runFile(ShellSettings& settings, const char* filename)
+    {
+        struct stat st;
+        if (toplevel == NULL || stat(filename, &st) < 0 || (uint64_t)st.st_size >= UINT32_T_MAX)
+            return evaluateFile(settings, filename);
+        
+        avmplus::PoolObject* pool = NULL;
+        if (reusePools) {
+            CachedPool* cached = findPool(filename, st.st_size, st.st_mtime);
+            if (cached != NULL)
+                pool = cached->pool;
+        }
+        
+        avmplus::ScriptBuffer code;
+        avmplus::ApiVersion apiVersion;
+        if (pool == NULL) {
+            MappedFile* file = map_file(filename);
+            if (file == NULL)
+                return evaluateFile(settings, filename);
+            code = avmplus::ScriptBuffer(new (GetGC()) avmplus::ReadOnlyScriptBufferImpl(file->bytes, file->size));
+            if (avmplus::AbcParser::canParse(code, &apiVersion) != 0) {
+                unmap_file(file);
+                return evaluateFile(settings, filename);    // swf, or source
+            }
+            holdMapping(file);
+        }
+        
+        return execute(pool, code, apiVersion, reusePools ? filename : NULL, &st);
+    }
+    
+    int AsshCore::runAbc(const uint8_t* abc, size_t abclen)
+    {
+        AvmAssert(toplevel != NULL);
+        
+        avmplus::ScriptBuffer code = newScriptBuffer(abclen);
+        VMPI_memcpy(code.getBuffer(), abc, abclen);
+        avmplus::ApiVersion apiVersion;
+        if (avmplus::AbcParser::canParse(code, &apiVersion) != 0) {
+            console << "not an abc file\n";
+            return 1;
+        }
+        return execute(NULL, code, apiVersion, NULL, NULL);
+    }
+    
+    // Output of benchmark runs after the first goes nowhere.
+    class DiscardOutput : public OutputSink
+    {
+    public:
+        virtual void write(const char*, size_t) {}
+    };
+    
+    bool AsshCore::bench(const uint8_t* abc, size_t abclen, const char* function, int warmup, int n, uint64_t* ticks)
+    {
+        AvmAssert(toplevel != NULL);
+        
+        avmplus::ApiVersion apiVersion;
+        avmplus::PoolObject* pool = parse(abc, abclen, &apiVersion);
+        if (pool == NULL)
+            return false;
+        if (jitmap != NULL)
+            jitmap->begin();
+        
+        // The script's init runs once, outside the timing, so only the
+        // calls are measured: no new scripts, vtables or closures per run.
+        OutputSink* output = get_thread_output();
+        DiscardOutput discard;
+        bool volatile ok = true;
+        setStackLimit();
+        TRY(this, avmplus::kCatchAction_ReportAsError)
+        {
+            ShellCodeContext* codeContext = new (GetGC()) ShellCodeContext(toplevel->domainEnv());
+            avmplus::ScriptEnv* main = handleActionPool(pool, toplevel, codeContext);
+            avmplus::ScriptObject* global = main->global;
+            avmplus::Atom f = global->getStringProperty(internStringLatin1(function));
+            if (!avmplus::AvmCore::isObject(f)) {
+                console << function << " is not defined\n";
+                ok = false;
+            }
+            else {
+                avmplus::ScriptObject* fn = avmplus::AvmCore::atomToScriptObject(f);
+                avmplus::Atom receiver = global->atom();
+                for (int i=0 ; i < warmup + n ; i++) {
+                    if (i == 1)
+                        set_thread_output(&discard);
+                    uint64_t start = VMPI_getPerformanceCounter();
+                    fn->call(0, &receiver);
+                    if (i >= warmup)
+                        ticks[i - warmup] = VMPI_getPerformanceCounter() - start;
+                }
+            }
+        }
+        CATCH(avmplus::Exception *exception)
+        {
+            set_thread_output(output);
+            reportException(exception);
+            ok = false;
+        }
+        END_CATCH
+        END_TRY
+        
+        set_thread_output(output);
+        if (jitmap != NULL)
+            scanJitted();
+        return ok;
+    }
+    
+    // Reports an uncaught exception the way ShellCore::evaluateFile does:
+    // with its stack trace in debugger builds, and not a second time if
+    // the debugger has already shown it.
+    void AsshCore::reportException(avmplus::Exception* exception)
+    {
+#ifdef DEBUGGER
+        if (!(exception->flags & avmplus::Exception::SEEN_BY_DEBUGGER))
+            console << string(exception->atom) << "\n";
+        if (exception->getStackTrace())
+            console << exception->getStackTrace()->format(this) << "\n";
+#else
+        console << string(exception->atom) << "\n";
+#endif
+    }
+    
+    // Parses abc in the shell toplevel, reporting and returning NULL if it
+    // doesn't parse.
+    avmplus::PoolObject* AsshCore::parse(const uint8_t* abc, size_t abclen, avmplus::ApiVersion* apiVersion)
+    {
+        avmplus::ScriptBuffer code = newScriptBuffer(abclen);
+        VMPI_memcpy(code.getBuffer(), abc, abclen);
+        if (avmplus::AbcParser::canParse(code, apiVersion) != 0) {
+            console << "not an abc file\n";
+            return NULL;
+        }
+        
+        avmplus::PoolObject* volatile pool = NULL;
+        setStackLimit();
+        TRY(this, avmplus::kCatchAction_ReportAsError)
+        {
+            pool = parseActionBlock(code, 0, toplevel, toplevel->domainEnv()->domain(), NULL, *apiVersion);
+        }
+        CATCH(avmplus::Exception *exception)
+        {
+            reportException(exception);
+        }
+        END_CATCH
+        END_TRY
+        
+        return pool;
+    }
+    
+    // Parses code unless pool is already given, then runs the pool in the
+    // shell toplevel.  With keepAs, a newly parsed pool is kept under that
+    // name and st's size and mtime.
+    int AsshCore::execute(avmplus::PoolObject* pool, avmplus::ScriptBuffer code, avmplus::ApiVersion apiVersion,
+                          const char* keepAs, const struct stat* st)
+    {
+        int exitCode = 0;
+        setStackLimit();
+        TRY(this, avmplus::kCatchAction_ReportAsError)
+        {
+            if (pool == NULL) {
+                pool = parseActionBlock(code, 0, toplevel, toplevel->domainEnv()->domain(), NULL, apiVersion);
+                if (keepAs != NULL)
+                    keepPool(keepAs, st->st_size, st->st_mtime, pool);
+            }
+            ShellCodeContext* codeContext = new (GetGC()) ShellCodeContext(toplevel->domainEnv());
+            handleActionPool(pool, toplevel, codeContext);
+        }
+        CATCH(avmplus::Exception *exception)
+        {
+            reportException(exception);
+            exitCode = 1;
+        }
+        END_CATCH
+        END_TRY
+        
+        return exitCode;
+    }
+    
+    AsshCore::CachedPool* AsshCore::findPool(const char* filename, uint64_t size, int64_t mtime)
+    {
+        for (CachedPool** p = &pools; *p != NULL; p = &(*p)->next) {
+            CachedPool* c = *p;
+            if (c->size != size || c->mtime != mtime || VMPI_strcmp(c->filename, filename) != 0)
+                continue;
+            
+            // Move to the front.
+            *p = c->next;
+            c->next = pools;
+            pools = c;
+            return c;
+        }
+        return NULL;
+    }
+    
+    void AsshCore::keepPool(const char* filename, uint64_t size, int64_t mtime, avmplus::PoolObject* pool)
+    {
+        // A changed file leaves its old entry behind; it ages out like any other.
+        if (numPools == kMaxCachedPools) {
+            CachedPool** p = &pools;
+            while ((*p)->next != NULL)
+                p = &(*p)->next;
+            delete *p;
+            *p = NULL;
+            numPools--;
+        }
+        
+        CachedPool* c = new CachedPool(GetGC());
+        size_t len = VMPI_strlen(filename);
+        c->filename = (char*)VMPI_alloc(len + 1);
+        VMPI_memcpy(c->filename, filename, len + 1);
+        c->size = size;
+        c->mtime = mtime;
+        c->pool = pool;
+        c->next = pools;
+        pools = c;
+        numPools++;
+    }
+    
+    void AsshCore::holdMapping(MappedFile* file)
+    {
+        for (HeldMapping* m = mappings; m != NULL; m = m->next) {
+            if (m->file == file) {
+                unmap_file(file);   // Already held; drop the extra reference
+                return;
+            }
+        }
+        
+        HeldMapping* m = new HeldMapping;
+        m->file = file;
+        m->next = mappings;
+        mappings = m;
+    }
+}
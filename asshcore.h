@@ -0,0 +1,131 @@
+#ifndef assh_asshcore_h
+#define assh_asshcore_h
+
+#include "avmshell.h"
+#include "gcstats.h"
+#include "profiler.h"
+#include "jitmap.h"
+
+struct MappedFile;
+struct stat;
+
+namespace avmshell
+{
+    // The core assh runs scripts on.  It is a ShellCoreImpl that remembers
+    // its shell toplevel, which lets it run abc without going through
+    // ShellCore::evaluateFile and keep what it parsed for next time.
+    class AsshCore : public ShellCoreImpl
+    {
+    public:
+        AsshCore(MMgc::GC* gc, ShellSettings& settings, bool mainthread);
+        ~AsshCore();
+        
+        // Like evaluateFile, but abc is parsed straight from a read-only
+        // mapping of the file that all cores share, and with reusePools an
+        // abc file this core has run before (same path, size and mtime) is
+        // not parsed or verified again: the pool from the earlier run is run
+        // again, with its verified and compiled methods.  Anything that isn't
+        // plain abc goes to evaluateFile.
+        int runFile(ShellSettings& settings, const char* filename);
+        
+        // Runs abc that is already in memory, such as the output of a
+        // background compile.  The bytes are copied; call after setup().
+        int runAbc(const uint8_t* abc, size_t abclen);
+        
+        // Runs abc once, which must define the global function named
+        // function, then calls that function warmup times, then n times
+        // with each call's length in counter ticks stored in ticks[].
+        // Only the first call's output is shown.  Returns false, having
+        // reported the error, if anything throws.  Call after setup().
+        bool bench(const uint8_t* abc, size_t abclen, const char* function, int warmup, int n, uint64_t* ticks);
+        
+        // Caps this core's GC heap, in bytes; zero means no limit.  Past
+        // soft, checked after every collection against what survived it,
+        // or past hard, checked at every GC step against all bytes in use,
+        // the running script is interrupted with an out of memory error and
+        // overBudget stays set: the core should then be thrown away.  Needs
+        // -Dinterrupts, and the GC entered.
+        void setHeapBudget(size_t soft, size_t hard);
+        
+        // Bracket one evaluation, for gcstats, the profiler and the perf map.
+        void beginEval();
+        void endEval();
+        
+        bool reusePools;
+        bool overBudget;
+        GCStats* const gcstats;     // With -gcstats, or on a core that may run the REPL's .gc
+        Profiler* profiler;         // With -profile, or swapped in by .profile
+        volatile bool samplePending;    // Set by the profiler's sampler when it raises an interrupt
+        JitMap* const jitmap;       // With -perf-map
+        
+    protected:
+        virtual avmplus::Toplevel* createToplevel(avmplus::AbcEnv* abcEnv);
+        virtual void interrupt(avmplus::Toplevel* env, InterruptReason reason);
+        
+    private:
+        class HeapBudget : public MMgc::GCCallback
+        {
+        public:
+            HeapBudget(MMgc::GC* gc, AsshCore* core, size_t soft, size_t hard)
+            : MMgc::GCCallback(gc), core(core), soft(soft), hard(hard) {}
+            
+            virtual void postsweep();
+            virtual void stopGCActivity();
+            
+        private:
+            void exceeded();
+            
+            AsshCore* const core;
+            const size_t    soft;
+            const size_t    hard;
+        };
+        
+
+        // A pool kept from an earlier run.  Entries are GC roots so the
+        // pools they hold survive collections.
+        class CachedPool : public MMgc::GCRoot
+        {
+        public:
+            CachedPool(MMgc::GC* gc) : MMgc::GCRoot(gc), filename(NULL), pool(NULL), next(NULL) {}
+            ~CachedPool() { VMPI_free(filename); }
+            
+            char*                   filename;
+            uint64_t                size;
+            int64_t                 mtime;
+            avmplus::PoolObject*    pool;
+            CachedPool*             next;       // Most recently used first
+        };
+        
+        static const int kMaxCachedPools = 32;
+        
+        void reportException(avmplus::Exception* exception);
+        avmplus::PoolObject* parse(const uint8_t* abc, size_t abclen, avmplus::ApiVersion* apiVersion);
+        int execute(avmplus::PoolObject* pool, avmplus::ScriptBuffer code, avmplus::ApiVersion apiVersion,
+                    const char* keepAs, const struct stat* st);
+        
+        CachedPool* findPool(const char* filename, uint64_t size, int64_t mtime);
+        void keepPool(const char* filename, uint64_t size, int64_t mtime, avmplus::PoolObject* pool);
+        
+        // Pools keep pointing into the bytes they were parsed from, so the
+        // core holds every mapping it has parsed until it is destroyed.
+        struct HeldMapping
+        {
+            MappedFile*     file;
+            HeldMapping*    next;
+        };
+        
+        void holdMapping(MappedFile* file);
+        
+        void scanJitted();
+        
+        avmplus::Toplevel*  toplevel;       // The shell toplevel, once setup() has made it
+        CachedPool*         pools;
+        int                 numPools;
+        HeldMapping*        mappings;
+        HeapBudget*         budget;
+        LivePoolNode*       scannedPools;   // The head of livePools at the last scanJitted()
+        avmplus::PoolObject* scannedPool;   // ... and its pool then
+    };
+}
+
+#endif
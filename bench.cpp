@@ -0,0 +1,359 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "shell.h"
+#include "bench.h"
+
+#define BENCH_MAX_MODES   16
+#define BENCH_MAX_WORKERS 16
+
+struct BenchResult {
+    char   bench[NAME_MAX + 1];
+    char   mode[32];
+    int    workers;
+    double wall_ms;
+    double cpu_ms;
+    long   peak_rss_kb;
+    double gc_pause_ms;
+    int    exit;
+};
+
+static int compare_names( const void *a, const void *b ) {
+    return strcmp( *(char * const *)a, *(char * const *)b );
+}
+
+static bool is_bench( const char *name ) {
+    size_t len = strlen( name );
+    return name[0] != '.' &&
+           ( ( len > 4 && strcmp( name + len - 4, ".abc" ) == 0 ) ||
+             ( len > 3 && strcmp( name + len - 3, ".as" ) == 0 ) );
+}
+
+// Splits a comma-separated list in place; returns the number of items.
+static int split( char *list, char **items, int max ) {
+    int n = 0;
+    char *save = NULL;
+    for ( char *item = strtok_r( list, ",", &save ) ; item && n < max ; item = strtok_r( NULL, ",", &save ) )
+        items[n++] = item;
+    return n;
+}
+
+// The assh option for a runmode; "" for the default, NULL if unknown.
+static const char *mode_option( const char *mode, char *buf, size_t size ) {
+    int threshold;
+    char end;
+    if ( strcmp( mode, "mixed" ) == 0 )
+        return "";
+    if ( strcmp( mode, "interp" ) == 0 )
+        return "-Dinterp";
+    if ( strcmp( mode, "jit" ) == 0 )
+        return "-Ojit";
+    if ( sscanf( mode, "osr=%d%c", &threshold, &end ) == 1 && threshold >= 0 ) {
+        snprintf( buf, size, "-osr=%d", threshold );
+        return buf;
+    }
+    return NULL;
+}
+
+// GC pause totals from a -gcstats dump; 0 if there is none.
+static double read_gc_pauses( const char *path ) {
+    char buf[4096];
+    FILE *f = fopen( path, "r" );
+    double mark = 0, finish = 0, reap = 0;
+    if ( !f )
+        return 0;
+    while ( fgets( buf, sizeof(buf), f ) ) {
+        const char *p = strstr( buf, "\"pause_ms\":" );
+        if ( p && sscanf( p, "\"pause_ms\": { \"mark\": %lf, \"finish\": %lf, \"reap\": %lf", &mark, &finish, &reap ) == 3 )
+            break;
+    }
+    fclose( f );
+    return mark + finish + reap;
+}
+
+// One run of path in a fresh assh, its output thrown away.
+static void run_once( const char *self, const char *path, const char *modeopt, int workers, BenchResult *r ) {
+    char gcdump[] = "/tmp/assh-bench-XXXXXX";
+    int fd = mkstemp( gcdump );
+    if ( fd >= 0 )
+        close( fd );
+
+    char gcopt[PATH_MAX + 16], wopt[64];
+    snprintf( gcopt, sizeof(gcopt), "-gcstats=%s", gcdump );
+    // One repeat: more would run the file N times and turn on reuse_pools,
+    // and the rows would no longer compare with the workers=1 ones.
+    snprintf( wopt, sizeof(wopt), "%d,%d,1", workers, workers );
+
+    const char *argv[8];
+    int argc = 0;
+    argv[argc++] = self;
+    if ( *modeopt )
+        argv[argc++] = modeopt;
+    if ( workers > 1 ) {
+        argv[argc++] = "-w";
+        argv[argc++] = wopt;
+    }
+    argv[argc++] = gcopt;
+    argv[argc++] = path;
+    argv[argc] = NULL;
+
+    uint64_t start = VMPI_getPerformanceCounter();
+    pid_t pid = fork();
+    if ( pid == 0 ) {
+        int null = open( "/dev/null", O_WRONLY );
+        dup2( null, 1 );
+        dup2( null, 2 );
+        execvp( self, (char * const *)argv );
+        _exit(127);
+    }
+
+    int status = 0;
+    struct rusage ru;
+    memset( &ru, 0, sizeof(ru) );
+    if ( pid < 0 || wait4( pid, &status, 0, &ru ) < 0 ) {
+        perror( "bench" );
+        status = 127 << 8;
+    }
+    r->wall_ms = double(VMPI_getPerformanceCounter() - start) * 1000.0 / double(VMPI_getPerformanceFrequency());
+    r->cpu_ms = ( ru.ru_utime.tv_sec + ru.ru_stime.tv_sec ) * 1000.0 +
+                ( ru.ru_utime.tv_usec + ru.ru_stime.tv_usec ) / 1000.0;
+#ifdef __APPLE__
+    r->peak_rss_kb = ru.ru_maxrss / 1024;      // bytes here, KB on Linux
+#else
+    r->peak_rss_kb = ru.ru_maxrss;
+#endif
+    r->gc_pause_ms = read_gc_pauses( gcdump );
+    r->exit = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    unlink( gcdump );
+}
+
+// Writes s as a JSON string; names come from the directory listing and
+// may hold anything.
+static void print_string( FILE *out, const char *s ) {
+    fputc( '"', out );
+    for ( ; *s ; s++ ) {
+        if ( *s == '"' || *s == '\\' )
+            fprintf( out, "\\%c", *s );
+        else if ( (unsigned char)*s < 0x20 )
+            fprintf( out, "\\u%04x", *s );
+        else
+            fputc( *s, out );
+    }
+    fputc( '"', out );
+}
+
+// Reads a string written by print_string() into buf; returns what follows
+// it, or NULL if p doesn't start with one.
+static const char *parse_string( const char *p, char *buf, size_t size ) {
+    if ( *p++ != '"' )
+        return NULL;
+    size_t n = 0;
+    for ( ; *p && *p != '"' ; p++ ) {
+        int c = *p;
+        if ( c == '\\' ) {
+            unsigned int u;
+            if ( p[1] == 'u' && sscanf( p + 2, "%4x", &u ) == 1 ) {
+                c = u;
+                p += 5;
+            } else if ( *++p ) {
+                c = *p;
+            } else {
+                return NULL;
+            }
+        }
+        if ( n + 1 >= size )
+            return NULL;
+        buf[n++] = c;
+    }
+    buf[n] = 0;
+    return *p == '"' ? p + 1 : NULL;
+}
+
+static void print_result( FILE *out, const BenchResult *r, bool last ) {
+    fprintf( out, "    { \"bench\": " );
+    print_string( out, r->bench );
+    fprintf( out, ", \"mode\": " );
+    print_string( out, r->mode );
+    fprintf( out, ", \"workers\": %d, \"wall_ms\": %.3f, \"cpu_ms\": %.3f, "
+                  "\"peak_rss_kb\": %ld, \"gc_pause_ms\": %.3f, \"exit\": %d }%s\n",
+             r->workers, r->wall_ms, r->cpu_ms, r->peak_rss_kb, r->gc_pause_ms, r->exit,
+             last ? "" : "," );
+}
+
+int bench_suite( const char *self ) {
+    const char *dir = assh_settings.bench_dir;
+    DIR *d = opendir( dir );
+    if ( !d ) {
+        perror( dir );
+        return 1;
+    }
+    char **names = NULL;
+    int numnames = 0;
+    struct dirent *de;
+    while ( ( de = readdir( d ) ) != NULL ) {
+        if ( !is_bench( de->d_name ) )
+            continue;
+        names = (char **)realloc( names, ( numnames + 1 ) * sizeof(char *) );
+        names[numnames++] = strdup( de->d_name );
+    }
+    closedir( d );
+    qsort( names, numnames, sizeof(char *), compare_names );
+
+    char *modelist = strdup( assh_settings.bench_modes ), *workerlist = strdup( assh_settings.bench_workers );
+    char *modes[BENCH_MAX_MODES], *workerstrs[BENCH_MAX_WORKERS];
+    int nummodes = split( modelist, modes, BENCH_MAX_MODES );
+    int numworkers = split( workerlist, workerstrs, BENCH_MAX_WORKERS );
+    int workers[BENCH_MAX_WORKERS];
+    char modebufs[BENCH_MAX_MODES][32];
+    const char *modeopts[BENCH_MAX_MODES];
+
+    int failed = 0;
+    for ( int m=0 ; m < nummodes ; m++ ) {
+        modeopts[m] = mode_option( modes[m], modebufs[m], sizeof(modebufs[m]) );
+        if ( !modeopts[m] || strlen( modes[m] ) >= sizeof(((BenchResult *)0)->mode) ) {
+            printf( "bad value to -bench-modes: %s (mixed, interp, jit, osr=N)\n", modes[m] );
+            failed = 1;
+        }
+    }
+    for ( int w=0 ; w < numworkers ; w++ ) {
+        char *end;
+        workers[w] = strtol( workerstrs[w], &end, 10 );
+        if ( *end || workers[w] < 1 ) {
+            printf( "bad value to -bench-workers: %s\n", workerstrs[w] );
+            failed = 1;
+        }
+    }
+
+    FILE *out = stdout;
+    if ( !failed && assh_settings.bench_out && !( out = fopen( assh_settings.bench_out, "w" ) ) ) {
+        perror( assh_settings.bench_out );
+        failed = 1;
+    }
+
+    if ( !failed ) {
+        int total = numnames * nummodes * numworkers, done = 0;
+        fprintf( out, "{\n  \"suite\": " );
+        print_string( out, dir );
+        fprintf( out, ",\n  \"runs\": %d,\n  \"results\": [\n", assh_settings.bench_runs );
+        for ( int f=0 ; f < numnames ; f++ ) {
+            char path[PATH_MAX];
+            snprintf( path, sizeof(path), "%s/%s", dir, names[f] );
+            for ( int m=0 ; m < nummodes ; m++ ) {
+                for ( int w=0 ; w < numworkers ; w++ ) {
+                    // The fastest of the runs, all of whose numbers are kept
+                    // together; a failure anywhere makes the result a failure.
+                    BenchResult best, r;
+                    best.wall_ms = -1;
+                    int exitCode = 0;
+                    for ( int k=0 ; k < assh_settings.bench_runs ; k++ ) {
+                        run_once( self, path, modeopts[m], workers[w], &r );
+                        if ( r.exit != 0 && exitCode == 0 )
+                            exitCode = r.exit;
+                        if ( best.wall_ms < 0 || r.wall_ms < best.wall_ms )
+                            best = r;
+                    }
+                    snprintf( best.bench, sizeof(best.bench), "%s", names[f] );
+                    snprintf( best.mode, sizeof(best.mode), "%s", modes[m] );
+                    best.workers = workers[w];
+                    best.exit = exitCode;
+                    if ( exitCode != 0 )
+                        failed = 1;
+                    print_result( out, &best, ++done == total );
+                    fflush( out );
+                    fprintf( stderr, "bench: %s %s x%d: %.2f ms%s\n", names[f], modes[m], workers[w], best.wall_ms,
+                             exitCode ? " (failed)" : "" );
+                }
+            }
+        }
+        fprintf( out, "  ]\n}\n" );
+        if ( out != stdout )
+            fclose( out );
+    }
+
+    for ( int f=0 ; f < numnames ; f++ )
+        free( names[f] );
+    free( names );
+    free( modelist );
+    free( workerlist );
+    return failed;
+}
+
+// Reads the results of a -bench run back; NULL if the file can't be read.
+static BenchResult *load_results( const char *path, int *count ) {
+    FILE *f = fopen( path, "r" );
+    if ( !f ) {
+        perror( path );
+        return NULL;
+    }
+    BenchResult *results = NULL;
+    int n = 0;
+    char line[4096];
+    while ( fgets( line, sizeof(line), f ) ) {
+        BenchResult r;
+        const char *p = strstr( line, "{ \"bench\": " );
+        if ( !p || !( p = parse_string( p + 11, r.bench, sizeof(r.bench) ) ) ||
+             strncmp( p, ", \"mode\": ", 10 ) != 0 || !( p = parse_string( p + 10, r.mode, sizeof(r.mode) ) ) )
+            continue;
+        if ( sscanf( p, ", \"workers\": %d, \"wall_ms\": %lf, \"cpu_ms\": %lf, "
+                        "\"peak_rss_kb\": %ld, \"gc_pause_ms\": %lf, \"exit\": %d",
+                     &r.workers, &r.wall_ms, &r.cpu_ms, &r.peak_rss_kb, &r.gc_pause_ms, &r.exit ) != 6 )
+            continue;
+        results = (BenchResult *)realloc( results, ( n + 1 ) * sizeof(BenchResult) );
+        results[n++] = r;
+    }
+    fclose( f );
+    *count = n;
+    return results;
+}
+
+static double change( double base, double now ) {
+    return base > 0 ? ( now - base ) * 100.0 / base : 0;
+}
+
+int bench_compare( const char *basepath, const char *currentpath ) {
+    int numbase = 0, numcurrent = 0;
+    BenchResult *base = load_results( basepath, &numbase );
+    BenchResult *current = base ? load_results( currentpath, &numcurrent ) : NULL;
+    if ( !current ) {
+        free( base );
+        return 1;
+    }
+
+    const double t = assh_settings.bench_threshold;
+    int regressions = 0;
+    printf( "%-32s %-10s %3s %10s %8s %8s %8s\n", "bench", "mode", "w", "wall ms", "wall", "cpu", "rss" );
+    for ( int i=0 ; i < numcurrent ; i++ ) {
+        const BenchResult *now = &current[i], *was = NULL;
+        for ( int j=0 ; j < numbase && !was ; j++ )
+            if ( base[j].workers == now->workers && strcmp( base[j].bench, now->bench ) == 0 &&
+                 strcmp( base[j].mode, now->mode ) == 0 )
+                was = &base[j];
+
+        printf( "%-32s %-10s %3d %10.2f ", now->bench, now->mode, now->workers, now->wall_ms );
+        if ( !was ) {
+            printf( "%8s\n", "new" );
+            continue;
+        }
+        double wall = change( was->wall_ms, now->wall_ms ), cpu = change( was->cpu_ms, now->cpu_ms ),
+               rss = change( double(was->peak_rss_kb), double(now->peak_rss_kb) );
+        bool broke = now->exit != 0 && was->exit == 0;
+        bool worse = broke || wall > t || cpu > t || rss > t;
+        printf( "%+7.1f%% %+7.1f%% %+7.1f%%%s\n", wall, cpu, rss,
+                broke ? "  FAILS" : worse ? "  REGRESSION" : "" );
+        if ( worse )
+            regressions++;
+    }
+    printf( "%d regression%s beyond %.1f%% against %s\n", regressions, regressions == 1 ? "" : "s", t, basepath );
+
+    free( base );
+    free( current );
+    return regressions > 0;
+}
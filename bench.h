@@ -0,0 +1,29 @@
+#ifndef assh_bench_h
+#define assh_bench_h
+
+// assh -bench DIR: runs every .abc and .as file in DIR through the shell
+// once per combination of runmode and worker count, each run a fresh assh
+// process going through single_worker or multi_worker as usual, and
+// writes what it measured as JSON:
+//
+//   -bench-modes mixed,interp,jit,osr=N    runmodes (default mixed,interp,jit)
+//   -bench-workers 1,4                     worker counts; N > 1 runs the
+//                                          file once on -w N,N,1
+//   -bench-runs K                          best of K runs (default 3)
+//   -bench-out FILE                        instead of stdout
+//
+// Each result is one line of the "results" array, for the benefit of
+// -bench-compare and of grep:
+//
+//   { "bench": "f.abc", "mode": "jit", "workers": 1, "wall_ms": 12.345,
+//     "cpu_ms": 12.001, "peak_rss_kb": 9876, "gc_pause_ms": 1.234, "exit": 0 }
+//
+// assh -bench-compare BASE.json NEW.json [-bench-threshold PCT] lists how
+// each result moved against the baseline and fails if wall time, CPU time
+// or peak RSS got worse by more than PCT percent (default 5), or if a
+// benchmark that passed now fails.
+
+int bench_suite( const char *self );
+int bench_compare( const char *base, const char *current );
+
+#endif
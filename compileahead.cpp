@@ -0,0 +1,154 @@
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compileahead.h"
+#include "abccache.h"
+
+enum SlotState { SLOT_PENDING, SLOT_BUSY, SLOT_READY, SLOT_SKIPPED };
+
+struct Slot {
+    SlotState state;
+    uint8_t  *abc;
+    uint32_t  abclen;
+    char     *cached;   // or the -abc-cache entry it was compiled into
+};
+
+static pthread_mutex_t ahead_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  ahead_cond = PTHREAD_COND_INITIALIZER;
+static ShellSettings  *ahead_settings = NULL;
+static Slot           *slots = NULL;        // one per input file; NULL when off
+static int             numslots = 0;
+static int             next_slot = 0;       // the next file to compile
+static int             taken = 0;           // files the main core has started
+static int             window = 0;          // how far past taken we compile
+static bool            stopping = false;
+static pthread_t      *threads = NULL;
+static int             numthreads = 0;
+
+static unsigned long   ahead_compiled = 0;
+static unsigned long   ahead_skipped = 0;
+static uint64_t        ahead_wait = 0;      // main core waiting on us, in counter ticks
+
+static void *compile_thread( void * ) {
+    MMGC_ENTER_RETURN(NULL);
+
+    MMgc::GCConfig gcconfig;
+    MMgc::GC *gc = mmfx_new( MMgc::GC( MMgc::GCHeap::GetGCHeap(), gcconfig ) );
+    {
+        MMGC_GCENTER(gc);
+        // The compiler only needs a core for number formatting, so it is
+        // never set up and runs nothing.
+        ShellCore *core = new ShellCoreImpl( gc, *ahead_settings, false );
+
+        pthread_mutex_lock( &ahead_lock );
+        for (;;) {
+            while ( !stopping && next_slot < numslots && next_slot >= taken + window )
+                pthread_cond_wait( &ahead_cond, &ahead_lock );
+            if ( stopping || next_slot >= numslots )
+                break;
+
+            Slot *slot = &slots[next_slot];
+            const char *filename = ahead_settings->filenames[next_slot];
+            next_slot++;
+            slot->state = SLOT_BUSY;
+            pthread_mutex_unlock( &ahead_lock );
+
+            // With -abc-cache, compiling into the cache is enough: the main
+            // core runs the entry without looking the file up again, so
+            // the cache counts each file once.
+            char path[PATH_MAX];
+            bool ready;
+            if ( abc_cache_lookup( core, filename, path, sizeof(path) ) ) {
+                slot->cached = strdup( path );
+                ready = true;
+            }
+            else
+                ready = abc_compile_file( core, filename, &slot->abc, &slot->abclen );
+
+            pthread_mutex_lock( &ahead_lock );
+            slot->state = ready ? SLOT_READY : SLOT_SKIPPED;
+            pthread_cond_broadcast( &ahead_cond );
+        }
+        pthread_mutex_unlock( &ahead_lock );
+
+        delete core;
+    }
+    mmfx_delete( gc );
+    return NULL;
+}
+
+void compile_ahead_start( ShellSettings &settings, int nthreads ) {
+    ahead_settings = &settings;
+    numslots = settings.numfiles;
+    slots = (Slot *)calloc( numslots, sizeof(Slot) );
+    window = nthreads + 1;      // the file running, and one per thread beyond it
+    numthreads = nthreads;
+    threads = new pthread_t[nthreads];
+
+    for ( int i=0 ; i < nthreads ; i++ ) {
+        if ( pthread_create( &threads[i], NULL, compile_thread, NULL ) != 0 ) {
+            perror( "compile-ahead" );
+            exit(1);
+        }
+    }
+}
+
+bool compile_ahead_take( int index, uint8_t **abc, uint32_t *abclen, char **cached ) {
+    if ( !slots )
+        return false;
+
+    Slot *slot = &slots[index];
+    uint64_t start = VMPI_getPerformanceCounter();
+
+    pthread_mutex_lock( &ahead_lock );
+    while ( slot->state == SLOT_PENDING || slot->state == SLOT_BUSY )
+        pthread_cond_wait( &ahead_cond, &ahead_lock );
+    taken = index + 1;
+    pthread_cond_broadcast( &ahead_cond );
+    ahead_wait += VMPI_getPerformanceCounter() - start;
+    bool ready = slot->state == SLOT_READY;
+    if ( ready )
+        ahead_compiled++;
+    else
+        ahead_skipped++;
+    pthread_mutex_unlock( &ahead_lock );
+
+    *abc = slot->abc;
+    *abclen = slot->abclen;
+    *cached = slot->cached;
+    slot->abc = NULL;
+    slot->cached = NULL;
+    return ready;
+}
+
+void compile_ahead_stop() {
+    if ( !slots )
+        return;
+
+    pthread_mutex_lock( &ahead_lock );
+    stopping = true;
+    pthread_cond_broadcast( &ahead_cond );
+    pthread_mutex_unlock( &ahead_lock );
+
+    for ( int i=0 ; i < numthreads ; i++ )
+        pthread_join( threads[i], NULL );
+
+    for ( int i=0 ; i < numslots ; i++ ) {
+        free( slots[i].abc );
+        free( slots[i].cached );
+    }
+    free( slots );
+    delete [] threads;
+    slots = NULL;
+    threads = NULL;
+}
+
+void compile_ahead_report() {
+    if ( ahead_compiled + ahead_skipped > 0 )
+        fprintf( stderr, "compile-ahead: %lu files compiled in the background, %lu left to the main core, %.2f ms waiting\n",
+                 ahead_compiled, ahead_skipped,
+                 double(ahead_wait) * 1000.0 / double(VMPI_getPerformanceFrequency()) );
+}
@@ -0,0 +1,25 @@
+#ifndef assh_compileahead_h
+#define assh_compileahead_h
+
+#include "shell.h"
+
+// -compile-ahead N: while the main core runs input file i, N background
+// threads compile the .as files i+1..i+N, each on a bare core of its own.
+// Files still run one at a time, in order, on the main core; a file that
+// doesn't compile on its own (errors, includes) or isn't source is left
+// for the main core to load and report exactly as before.
+
+void compile_ahead_start( ShellSettings &settings, int nthreads );
+
+// Waits for the background work on file index, then, if it produced abc,
+// hands over the malloc'd buffer and returns true.  With -abc-cache the
+// abc is in the cache instead: *abc is NULL and *cached the malloc'd path
+// of the entry to run.  Returns false right away when compile-ahead is
+// off.  Call once per file, in order.
+bool compile_ahead_take( int index, uint8_t **abc, uint32_t *abclen, char **cached );
+
+void compile_ahead_stop();
+
+void compile_ahead_report();
+
+#endif
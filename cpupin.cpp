@@ -0,0 +1,70 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__APPLE__)
+#include <mach/mach.h>
+#include <mach/thread_policy.h>
+#elif defined(__linux__)
+#include <sched.h>
+#endif
+
+#include "cpupin.h"
+
+int parse_cpu_list( const char *val, int **cpus ) {
+    // A range counts once per CPU, so size the array in a first pass.
+    int count = 0;
+    for ( const char *p = val ; *p ; ) {
+        char *end;
+        long lo = strtol( p, &end, 10 ), hi = lo;
+        if ( end == p || lo < 0 )
+            return 0;
+        if ( *end == '-' ) {
+            p = end + 1;
+            hi = strtol( p, &end, 10 );
+            if ( end == p || hi < lo )
+                return 0;
+        }
+        count += int(hi - lo + 1);
+        if ( *end == ',' && end[1] )
+            end++;
+        else if ( *end )
+            return 0;
+        p = end;
+    }
+    if ( count == 0 )
+        return 0;
+
+    int *list = new int[count], n = 0;
+    for ( const char *p = val ; *p ; ) {
+        char *end;
+        long lo = strtol( p, &end, 10 ), hi = lo;
+        if ( *end == '-' )
+            hi = strtol( end + 1, &end, 10 );
+        for ( long cpu = lo ; cpu <= hi ; cpu++ )
+            list[n++] = int(cpu);
+        p = *end ? end + 1 : end;
+    }
+    *cpus = list;
+    return n;
+}
+
+bool pin_thread( int cpu ) {
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO( &set );
+    CPU_SET( cpu, &set );
+    return pthread_setaffinity_np( pthread_self(), sizeof(set), &set ) == 0;
+#elif defined(__APPLE__)
+    // Tag 0 means no affinity, so offset by one.
+    thread_affinity_policy_data_t policy = { cpu + 1 };
+    return thread_policy_set( pthread_mach_thread_np( pthread_self() ), THREAD_AFFINITY_POLICY,
+                              (thread_policy_t)&policy, THREAD_AFFINITY_POLICY_COUNT ) == KERN_SUCCESS;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
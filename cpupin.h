@@ -0,0 +1,17 @@
+#ifndef assh_cpupin_h
+#define assh_cpupin_h
+
+// -cpus LIST: pin each worker thread to one CPU of a list, so a thread
+// and the cores it runs keep their caches.  Thread i gets the CPU at
+// position i modulo the length of the list.
+
+// Parses "0,2,4-7" into a new[]'d array of CPU numbers.  Returns the
+// number of CPUs, or 0 if the list is malformed.
+int parse_cpu_list( const char *val, int **cpus );
+
+// Pins the calling thread to cpu.  On Linux this is a hard binding; on
+// Mac OS X only an affinity hint is available, so threads given the same
+// cpu are merely kept together.  Returns false where neither works.
+bool pin_thread( int cpu );
+
+#endif
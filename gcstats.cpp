@@ -0,0 +1,278 @@
+#include "shell.h"
+#include "gcstats.h"
+#include "samples.h"
+
+namespace avmshell
+{
+    // Heap size over time, across all collectors: one sample per finished
+    // collection, thinned out as the buffer fills.
+    struct HeapSample
+    {
+        double      ms;             // Since the first collector started
+        size_t      bytesInUse;     // By the collector that just swept
+        size_t      heapBytes;      // The whole GCHeap
+    };
+
+    static const int        kMaxHeapSamples = 1024;
+
+    static vmbase::RecursiveMutex   totals_lock;
+    static GCStats::Counts*         totals = NULL;      // Under totals_lock
+    static DecimatingSamples<HeapSample, kMaxHeapSamples> samples;     // Under totals_lock
+    static uint64_t                 startTicks = 0;
+
+    static double ticksToMs(uint64_t ticks)
+    {
+        return double(ticks) * 1000.0 / double(VMPI_getPerformanceFrequency());
+    }
+
+    void GCStats::Counts::add(const Counts& other)
+    {
+        for (int k=0 ; k < kNumPauseKinds ; k++) {
+            pauses[k] += other.pauses[k];
+            pauseTicks[k] += other.pauseTicks[k];
+        }
+        for (int b=0 ; b < kPauseBuckets ; b++)
+            histogram[b] += other.histogram[b];
+        maxPauseTicks = other.maxPauseTicks > maxPauseTicks ? other.maxPauseTicks : maxPauseTicks;
+        bytesFreed += other.bytesFreed;
+        evals += other.evals;
+        evalAllocated += other.evalAllocated;
+        evalFreed += other.evalFreed;
+        maxEvalAllocated = other.maxEvalAllocated > maxEvalAllocated ? other.maxEvalAllocated : maxEvalAllocated;
+        peakBytesInUse = other.peakBytesInUse > peakBytesInUse ? other.peakBytesInUse : peakBytesInUse;
+    }
+
+    GCStats::GCStats(MMgc::GC* gc)
+    : MMgc::GCCallback(gc)
+    , activityStart(0)
+    , swept(false)
+    , reaped(false)
+    , beforeSweep(0)
+    , beforeReap(0)
+    , evalStartBytes(0)
+    , evalStartFreed(0)
+    {
+        VMPI_memset(&counts, 0, sizeof(counts));
+        SCOPE_LOCK(totals_lock) {
+            if (startTicks == 0)
+                startTicks = VMPI_getPerformanceCounter();
+        }
+    }
+
+    GCStats::~GCStats()
+    {
+        SCOPE_LOCK(totals_lock) {
+            if (totals == NULL) {
+                totals = new Counts;
+                VMPI_memset(totals, 0, sizeof(Counts));
+            }
+            totals->add(counts);
+        }
+    }
+
+    /* virtual */
+    void GCStats::startGCActivity()
+    {
+        activityStart = VMPI_getPerformanceCounter();
+        swept = false;
+        reaped = false;
+    }
+
+    /* virtual */
+    void GCStats::stopGCActivity()
+    {
+        uint64_t ticks = VMPI_getPerformanceCounter() - activityStart;
+        PauseKind kind = swept ? kFinish : reaped ? kReap : kMark;
+
+        counts.pauses[kind]++;
+        counts.pauseTicks[kind] += ticks;
+        counts.histogram[bucketFor(ticks * 1000000 / VMPI_getPerformanceFrequency())]++;
+        if (ticks > counts.maxPauseTicks)
+            counts.maxPauseTicks = ticks;
+    }
+
+    /* virtual */
+    void GCStats::presweep()
+    {
+        beforeSweep = GetGC()->GetBytesInUse();
+    }
+
+    /* virtual */
+    void GCStats::postsweep()
+    {
+        size_t after = GetGC()->GetBytesInUse();
+        swept = true;
+        if (beforeSweep > after)
+            counts.bytesFreed += beforeSweep - after;
+        if (beforeSweep > counts.peakBytesInUse)
+            counts.peakBytesInUse = beforeSweep;
+        sample();
+    }
+
+    /* virtual */
+    void GCStats::prereap()
+    {
+        beforeReap = GetGC()->GetBytesInUse();
+    }
+
+    /* virtual */
+    void GCStats::postreap()
+    {
+        size_t after = GetGC()->GetBytesInUse();
+        reaped = true;
+        if (beforeReap > after)
+            counts.bytesFreed += beforeReap - after;
+    }
+
+    void GCStats::beginEval()
+    {
+        evalStartBytes = GetGC()->GetBytesInUse();
+        evalStartFreed = counts.bytesFreed;
+    }
+
+    void GCStats::endEval()
+    {
+        size_t after = GetGC()->GetBytesInUse();
+        uint64_t freed = counts.bytesFreed - evalStartFreed;
+        // What is in use now is what was there, plus what was allocated,
+        // minus what the collector freed in between.
+        uint64_t allocated = after + freed > evalStartBytes ? after + freed - evalStartBytes : 0;
+
+        counts.evals++;
+        counts.evalAllocated += allocated;
+        counts.evalFreed += freed;
+        counts.lastEvalAllocated = allocated;
+        counts.lastEvalFreed = freed;
+        if (allocated > counts.maxEvalAllocated)
+            counts.maxEvalAllocated = allocated;
+        if (after > counts.peakBytesInUse)
+            counts.peakBytesInUse = after;
+    }
+
+    void GCStats::sample()
+    {
+        MMgc::GCHeap* heap = MMgc::GCHeap::GetGCHeap();
+
+        SCOPE_LOCK(totals_lock) {
+            HeapSample* s = samples.next();
+            if (s == NULL)
+                return;
+            s->ms = ticksToMs(VMPI_getPerformanceCounter() - startTicks);
+            s->bytesInUse = GetGC()->GetBytesInUse();
+            s->heapBytes = heap->GetTotalHeapSize() * MMgc::GCHeap::kBlockSize;
+        }
+    }
+
+    /* static */
+    int GCStats::bucketFor(uint64_t us)
+    {
+        if (us < 4)
+            return int(us);
+        int msb = 63 - __builtin_clzll(us);
+        int bucket = 4 * (msb - 1) + int((us >> (msb - 2)) & 3);
+        return bucket < kPauseBuckets ? bucket : kPauseBuckets - 1;
+    }
+
+    /* static */
+    uint64_t GCStats::bucketLowerBound(int bucket)
+    {
+        if (bucket < 4)
+            return uint64_t(bucket);
+        return uint64_t(4 + bucket % 4) << (bucket / 4 - 1);
+    }
+
+    // The lower bound of the bucket holding the p'th pause, in microseconds.
+    /* static */
+    uint64_t GCStats::percentile(const Counts& c, double p)
+    {
+        uint64_t n = 0;
+        for (int k=0 ; k < kNumPauseKinds ; k++)
+            n += c.pauses[k];
+
+        uint64_t rank = uint64_t(p * double(n)), seen = 0;
+        for (int b=0 ; b < kPauseBuckets ; b++) {
+            seen += c.histogram[b];
+            if (seen > rank)
+                return bucketLowerBound(b);
+        }
+        return 0;
+    }
+
+    /* static */
+    void GCStats::printCounts(FILE* f, const Counts& c)
+    {
+        static const char* const names[kNumPauseKinds] = { "mark", "finish", "reap" };
+
+        for (int k=0 ; k < kNumPauseKinds ; k++)
+            fprintf(f, "gc %-6s %8llu pauses, %.2f ms\n", names[k],
+                    (unsigned long long)c.pauses[k], ticksToMs(c.pauseTicks[k]));
+        fprintf(f, "gc pauses: p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+                double(percentile(c, 0.50)) / 1000.0, double(percentile(c, 0.99)) / 1000.0,
+                ticksToMs(c.maxPauseTicks));
+        fprintf(f, "gc freed: %llu KB, peak in use %lu KB\n",
+                (unsigned long long)(c.bytesFreed / 1024), (unsigned long)(c.peakBytesInUse / 1024));
+        if (c.evals > 0)
+            fprintf(f, "gc per eval: %llu evals, %llu KB allocated and %llu KB freed on average, %llu KB allocated at most\n",
+                    (unsigned long long)c.evals,
+                    (unsigned long long)(c.evalAllocated / c.evals / 1024), (unsigned long long)(c.evalFreed / c.evals / 1024),
+                    (unsigned long long)(c.maxEvalAllocated / 1024));
+    }
+
+    void GCStats::print(FILE* f)
+    {
+        printCounts(f, counts);
+        if (counts.evals > 0)
+            fprintf(f, "gc last eval: %llu KB allocated, %llu KB freed\n",
+                    (unsigned long long)(counts.lastEvalAllocated / 1024), (unsigned long long)(counts.lastEvalFreed / 1024));
+    }
+
+    /* static */
+    void GCStats::report(FILE* f, const char* dumpPath, ShellSettings& settings)
+    {
+        SCOPE_LOCK(totals_lock) {
+            if (totals == NULL)
+                return;
+
+            printCounts(f, *totals);
+            if (dumpPath == NULL)
+                return;
+
+            FILE* dump = fopen(dumpPath, "w");
+            if (dump == NULL) {
+                perror(dumpPath);
+                return;
+            }
+
+            const Counts& c = *totals;
+            fprintf(dump, "{\n  \"config\": { \"gcthreshold\": %u, \"gcstack\": %d, \"drc\": %s, \"exactgc\": %s, \"incremental\": %s },\n",
+                    (unsigned)settings.gcthreshold, (int)settings.markstackAllowance,
+                    settings.drc ? "true" : "false", settings.exactgc ? "true" : "false",
+                    settings.gcMode() == MMgc::kIncrementalGC ? "true" : "false");
+            fprintf(dump, "  \"collections\": { \"mark\": %llu, \"finish\": %llu, \"reap\": %llu },\n",
+                    (unsigned long long)c.pauses[kMark], (unsigned long long)c.pauses[kFinish], (unsigned long long)c.pauses[kReap]);
+            fprintf(dump, "  \"pause_ms\": { \"mark\": %.3f, \"finish\": %.3f, \"reap\": %.3f },\n",
+                    ticksToMs(c.pauseTicks[kMark]), ticksToMs(c.pauseTicks[kFinish]), ticksToMs(c.pauseTicks[kReap]));
+            fprintf(dump, "  \"pauses\": { \"p50_us\": %llu, \"p99_us\": %llu, \"max_us\": %llu,\n    \"histogram_us\": [",
+                    (unsigned long long)percentile(c, 0.50), (unsigned long long)percentile(c, 0.99),
+                    (unsigned long long)(c.maxPauseTicks * 1000000 / VMPI_getPerformanceFrequency()));
+            const char* sep = "";
+            for (int b=0 ; b < kPauseBuckets ; b++) {
+                if (c.histogram[b] == 0)
+                    continue;
+                fprintf(dump, "%s[%llu, %llu]", sep, (unsigned long long)bucketLowerBound(b), (unsigned long long)c.histogram[b]);
+                sep = ", ";
+            }
+            fprintf(dump, "] },\n");
+            fprintf(dump, "  \"evals\": { \"count\": %llu, \"allocated_bytes\": %llu, \"freed_bytes\": %llu, \"max_allocated_bytes\": %llu },\n",
+                    (unsigned long long)c.evals, (unsigned long long)c.evalAllocated,
+                    (unsigned long long)c.evalFreed, (unsigned long long)c.maxEvalAllocated);
+            fprintf(dump, "  \"heap\": { \"freed_bytes\": %llu, \"peak_in_use_bytes\": %lu,\n    \"samples\": [",
+                    (unsigned long long)c.bytesFreed, (unsigned long)c.peakBytesInUse);
+            for (int i=0 ; i < samples.size() ; i++)
+                fprintf(dump, "%s\n      { \"ms\": %.3f, \"in_use\": %lu, \"heap\": %lu }", i ? "," : "",
+                        samples[i].ms, (unsigned long)samples[i].bytesInUse, (unsigned long)samples[i].heapBytes);
+            fprintf(dump, "%s] }\n}\n", samples.size() ? "\n    " : "");
+            fclose(dump);
+        }
+    }
+}
@@ -0,0 +1,80 @@
+#ifndef assh_gcstats_h
+#define assh_gcstats_h
+
+#include <stdio.h>
+
+#include "avmshell.h"
+
+namespace avmshell
+{
+    // What one core's collector has been doing: collections by kind, a
+    // pause histogram, and the bytes each evaluation allocated and freed.
+    // Every AsshCore has one; .gc prints the REPL core's, and -gcstats
+    // prints the whole process's at exit, when each core's numbers have
+    // been folded into the process totals.
+    class GCStats : public MMgc::GCCallback
+    {
+    public:
+        GCStats(MMgc::GC* gc);
+        virtual ~GCStats();     // Adds this collector's numbers to the totals
+
+        virtual void startGCActivity();
+        virtual void stopGCActivity();
+        virtual void presweep();
+        virtual void postsweep();
+        virtual void prereap();
+        virtual void postreap();
+
+        // Bracket one evaluation: a file, a REPL line, a batch program.
+        void beginEval();
+        void endEval();
+
+        void print(FILE* f);
+
+        // Process totals, once the cores are gone: a summary on f and,
+        // with dumpPath, the same as JSON in that file.
+        static void report(FILE* f, const char* dumpPath, ShellSettings& settings);
+
+        // Pause lengths in microseconds, four buckets per power of two.
+        static const int kPauseBuckets = 4 * 40;
+
+        enum PauseKind { kMark, kFinish, kReap, kNumPauseKinds };
+
+        struct Counts
+        {
+            uint64_t    pauses[kNumPauseKinds];
+            uint64_t    pauseTicks[kNumPauseKinds];
+            uint64_t    maxPauseTicks;
+            uint64_t    histogram[kPauseBuckets];
+            uint64_t    bytesFreed;
+            uint64_t    evals;
+            uint64_t    evalAllocated;
+            uint64_t    evalFreed;
+            uint64_t    maxEvalAllocated;
+            uint64_t    lastEvalAllocated;
+            uint64_t    lastEvalFreed;
+            size_t      peakBytesInUse;
+
+            void add(const Counts& other);
+        };
+
+    private:
+        static int bucketFor(uint64_t us);
+        static uint64_t bucketLowerBound(int bucket);
+        static uint64_t percentile(const Counts& c, double p);
+        static void printCounts(FILE* f, const Counts& c);
+
+        void sample();
+
+        Counts      counts;
+        uint64_t    activityStart;
+        bool        swept;          // During this activity
+        bool        reaped;
+        size_t      beforeSweep;
+        size_t      beforeReap;
+        size_t      evalStartBytes;
+        uint64_t    evalStartFreed;
+    };
+}
+
+#endif
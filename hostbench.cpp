@@ -0,0 +1,277 @@
+// asshbench: micro-benchmarks for assh's own overheads, as opposed to the
+// scripts it runs.
+//
+//   asshbench [-samples N] [name...]
+//
+//   gc_init      gc_init() in a fresh process (one fork per sample)
+//   core         a new GC and AsshCore, through setup()
+//   eval         eval_string() of a trivial statement on a set-up core
+//   dispatch     master to slave handover of a job in multi_worker
+//   console      ConsoleOutputStream throughput into /dev/null
+//
+// An eval or console sample is a batch of operations sized to take at
+// least BATCH_MIN_MS, after a warmup batch, so timer resolution and
+// one-off costs drop out; gc_init, core and dispatch take long enough to
+// be sampled one at a time, and the first tenth of the dispatches, made
+// while the pool warms up, are dropped.  Reported are
+// the median per operation with a 95% confidence interval for it (from
+// order statistics, so no assumption about the distribution), the median
+// absolute deviation, and the minimum.  Results go to stdout; the shell's
+// own output goes to /dev/null.
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "shell.h"
+
+#define DEFAULT_SAMPLES 30
+#define BATCH_MIN_MS    10
+#define DISPATCH_JOBS   2000
+#define CONSOLE_CHUNK   64
+
+static FILE          *report = NULL;
+static ShellSettings *bench_settings = NULL;
+
+static uint64_t now() {
+    return VMPI_getPerformanceCounter();
+}
+
+static double ticks_to_us( double ticks ) {
+    return ticks * 1000000.0 / double(VMPI_getPerformanceFrequency());
+}
+
+static int compare_doubles( const void *a, const void *b ) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// Prints the statistics of n per-operation samples, in counter ticks;
+// sorts samples.  With bytes, also the throughput they make.
+static void print_stats( const char *name, double *samples, int n, size_t bytes ) {
+    qsort( samples, n, sizeof(double), compare_doubles );
+    double median = samples[n / 2];
+
+    // The ranks bounding a 95% confidence interval for the median.
+    int half = int( 0.98 * sqrt( double(n) ) + 0.5 );
+    int lo = n / 2 - half < 0 ? 0 : n / 2 - half, hi = n / 2 + half >= n ? n - 1 : n / 2 + half;
+
+    double *dev = new double[n];
+    for ( int i=0 ; i < n ; i++ )
+        dev[i] = fabs( samples[i] - median );
+    qsort( dev, n, sizeof(double), compare_doubles );
+    double mad = dev[n / 2];
+    delete [] dev;
+
+    fprintf( report, "%-10s %10.3f us  [%.3f, %.3f]  mad %5.1f%%  min %.3f us  (%d samples)",
+             name, ticks_to_us( median ), ticks_to_us( samples[lo] ), ticks_to_us( samples[hi] ),
+             median > 0 ? mad * 100.0 / median : 0.0, ticks_to_us( samples[0] ), n );
+    if ( bytes )
+        fprintf( report, "  %.1f MB/s", double(bytes) / ticks_to_us( median ) );
+    fprintf( report, "\n" );
+    fflush( report );
+}
+
+// Times run( n ) in batches big enough to time well: samples[i] is the
+// time per operation in batch i.
+static void sample_batches( void (*run)( int ), double *samples, int n ) {
+    uint64_t min_ticks = VMPI_getPerformanceFrequency() * BATCH_MIN_MS / 1000;
+    int batch = 1;
+    for (;;) {
+        uint64_t start = now();
+        run( batch );
+        if ( now() - start >= min_ticks )
+            break;
+        batch *= 2;
+    }
+    run( batch );   // warm up at the final size
+    for ( int i=0 ; i < n ; i++ ) {
+        uint64_t start = now();
+        run( batch );
+        samples[i] = double(now() - start) / batch;
+    }
+}
+
+// gc_init runs once per process, so every sample is a fresh process.
+// Before the harness's own gc_init, which the children must not inherit.
+static void bench_gc_init( int n ) {
+    double *samples = new double[n];
+    for ( int i=0 ; i < n ; i++ ) {
+        int fds[2];
+        uint64_t ticks = 0;
+        if ( pipe( fds ) < 0 ) {
+            perror( "pipe" );
+            exit(1);
+        }
+        pid_t pid = fork();
+        if ( pid == 0 ) {
+            uint64_t start = now();
+            gc_init();
+            ticks = now() - start;
+            if ( write( fds[1], &ticks, sizeof(ticks) ) != sizeof(ticks) )
+                _exit(1);
+            _exit(0);
+        }
+        close( fds[1] );
+        if ( pid < 0 || read( fds[0], &ticks, sizeof(ticks) ) != sizeof(ticks) ) {
+            fprintf( stderr, "asshbench: gc_init child failed\n" );
+            exit(1);
+        }
+        close( fds[0] );
+        waitpid( pid, NULL, 0 );
+        samples[i] = double(ticks);
+    }
+    print_stats( "gc_init", samples, n, 0 );
+    delete [] samples;
+}
+
+static MMgc::GC *new_gc() {
+    MMgc::GCConfig gcconfig;
+    return mmfx_new( MMgc::GC( MMgc::GCHeap::GetGCHeap(), gcconfig ) );
+}
+
+// Construction and setup are timed; tearing the core down again is not.
+static void bench_core( int n ) {
+    double *samples = new double[n];
+    for ( int i=0 ; i < n ; i++ ) {
+        MMgc::GC *gc = new_gc();
+        uint64_t start = now(), ticks;
+        {
+            MMGC_GCENTER(gc);
+            AsshCore *core = new AsshCore( gc, *bench_settings, true );
+            if ( !core->setup( *bench_settings ) )
+                exit(1);
+            ticks = now() - start;
+            delete core;
+        }
+        mmfx_delete( gc );
+        samples[i] = double(ticks);
+    }
+    print_stats( "core", samples, n, 0 );
+    delete [] samples;
+}
+
+static void run_eval( int n ) {
+    static char statement[] = "var x = 1;";
+    for ( int i=0 ; i < n ; i++ )
+        eval_string( statement );
+}
+
+static void run_console( int n ) {
+    static const char chunk[CONSOLE_CHUNK + 1] =
+        "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcde\n";
+    for ( int i=0 ; i < n ; i++ )
+        repl_core->console << chunk;
+    output_flush();
+}
+
+// On the core that eval and console share, set up once.
+static void bench_on_core( const char *name, void (*run)( int ), int n, size_t bytes ) {
+    MMgc::GC *gc = new_gc();
+    {
+        MMGC_GCENTER(gc);
+        repl_core = new AsshCore( gc, *bench_settings, true );
+        if ( !repl_core->setup( *bench_settings ) )
+            exit(1);
+        double *samples = new double[n];
+        sample_batches( run, samples, n );
+        print_stats( name, samples, n, bytes );
+        delete [] samples;
+        delete repl_core;
+        repl_core = NULL;
+    }
+    mmfx_delete( gc );
+}
+
+// The pool runs an empty script over and over; each handover is a sample.
+static void bench_dispatch() {
+    char script[] = "/tmp/asshbench-XXXXXX.as";
+    int fd = mkstemps( script, 3 );
+    if ( fd < 0 || write( fd, ";\n", 2 ) != 2 ) {
+        perror( "asshbench" );
+        exit(1);
+    }
+    close( fd );
+
+    char *files[] = { script };
+    ShellSettings settings;
+    settings.filenames = files;
+    settings.numfiles = 1;
+    settings.do_repl = false;
+    settings.numthreads = 2;
+    settings.numworkers = 2;
+    settings.repeats = DISPATCH_JOBS;
+
+    uint64_t *ticks = new uint64_t[DISPATCH_JOBS];
+    assh_settings.dispatch_samples = ticks;
+    assh_settings.max_dispatch_samples = DISPATCH_JOBS;
+    multi_worker( settings );
+    assh_settings.dispatch_samples = NULL;
+    unlink( script );
+
+    // Skip the first jobs, dispatched while the pool was still warming.
+    int skip = DISPATCH_JOBS / 10, count = DISPATCH_JOBS - skip;
+    double *samples = new double[count];
+    for ( int i=0 ; i < count ; i++ )
+        samples[i] = double(ticks[skip + i]);
+    print_stats( "dispatch", samples, count, 0 );
+    delete [] samples;
+    delete [] ticks;
+}
+
+static bool wanted( const char *name, char **names, int numnames ) {
+    if ( numnames == 0 )
+        return true;
+    for ( int i=0 ; i < numnames ; i++ )
+        if ( strcmp( names[i], name ) == 0 )
+            return true;
+    return false;
+}
+
+int main( int argc, char **argv ) {
+    int n = DEFAULT_SAMPLES;
+    int i = 1;
+    if ( i + 1 < argc && strcmp( argv[i], "-samples" ) == 0 ) {
+        n = atoi( argv[i + 1] );
+        i += 2;
+    }
+    if ( n < 1 ) {
+        fprintf( stderr, "usage: asshbench [-samples N] [gc_init|core|eval|dispatch|console ...]\n" );
+        return 2;
+    }
+    char **names = argv + i;
+    int numnames = argc - i;
+
+    // Results on the real stdout; everything the shell writes to /dev/null.
+    report = fdopen( dup( 1 ), "w" );
+    int null = open( "/dev/null", O_WRONLY );
+    dup2( null, 1 );
+    close( null );
+
+    if ( wanted( "gc_init", names, numnames ) )
+        bench_gc_init( n );
+
+    gc_init();
+    {
+        MMGC_ENTER_RETURN(OUT_OF_MEMORY);
+
+        ShellSettings settings;
+        bench_settings = &settings;
+        output_init( FLUSH_BLOCK, OUTPUT_DEFAULT_SIZE );
+
+        if ( wanted( "core", names, numnames ) )
+            bench_core( n );
+        if ( wanted( "eval", names, numnames ) )
+            bench_on_core( "eval", run_eval, n, 0 );
+        if ( wanted( "dispatch", names, numnames ) )
+            bench_dispatch();
+        if ( wanted( "console", names, numnames ) )
+            bench_on_core( "console", run_console, n, CONSOLE_CHUNK );
+    }
+    gc_end();
+    return 0;
+}
@@ -0,0 +1,386 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <elf.h>
+#include <sys/syscall.h>
+#endif
+
+#include "shell.h"
+#include "jitmap.h"
+
+namespace avmshell
+{
+    // jitdump, as perf's tools/perf/Documentation/jitdump-specification.txt
+    // has it.
+    struct JitDumpHeader
+    {
+        uint32_t    magic;
+        uint32_t    version;
+        uint32_t    total_size;
+        uint32_t    elf_mach;
+        uint32_t    pad1;
+        uint32_t    pid;
+        uint64_t    timestamp;
+        uint64_t    flags;
+    };
+    
+    struct JitCodeLoad
+    {
+        uint32_t    id;
+        uint32_t    total_size;
+        uint64_t    timestamp;
+        uint32_t    pid;
+        uint32_t    tid;
+        uint64_t    vma;
+        uint64_t    code_addr;
+        uint64_t    code_size;
+        uint64_t    code_index;
+        // The name, NUL-terminated, and the code follow.
+    };
+    
+    static const uint32_t   kJitDumpMagic = 0x4A695444;     // "JiTD"
+    static const uint32_t   kJitCodeLoad = 0;
+    static const size_t     kMaxCodeSize = 64 * 1024;       // For the topmost method of a chunk
+    
+    static vmbase::RecursiveMutex   files_lock;
+    static bool                     wantDump = false;
+    static pid_t                    filesPid = 0;           // Under files_lock: whose files are open
+    static int                      mapFd = -1;             // Likewise
+    static int                      dumpFd = -1;            // Likewise
+    static void*                    dumpMarker = NULL;      // Likewise
+    static uint64_t                 codeIndex = 0;          // Likewise
+    static unsigned long            numMethods = 0;         // Likewise
+    static uint64_t                 numBytes = 0;           // Likewise
+    static uintptr_t*               codeStarts = NULL;      // Likewise: every method written, sorted
+    static size_t                   numStarts = 0;          // Likewise
+    static size_t                   maxStarts = 0;          // Likewise
+    
+    static uint64_t monotonicNs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return uint64_t(ts.tv_sec) * 1000000000 + uint64_t(ts.tv_nsec);
+    }
+    
+    static uint32_t elfMachine()
+    {
+#if defined(__x86_64__)
+        return EM_X86_64;
+#elif defined(__i386__)
+        return EM_386;
+#elif defined(__aarch64__)
+        return EM_AARCH64;
+#elif defined(__arm__)
+        return EM_ARM;
+#else
+        return 0;
+#endif
+    }
+    
+    // A child of -prefork has a pid, and so files, of its own; opens them
+    // the first time the calling process writes.  Call under files_lock.
+    static bool openFiles()
+    {
+        pid_t pid = getpid();
+        if (filesPid == pid)
+            return mapFd >= 0;
+        
+        // What the parent had open stays the parent's.
+        if (mapFd >= 0)
+            close(mapFd);
+        if (dumpFd >= 0) {
+            munmap(dumpMarker, sysconf(_SC_PAGESIZE));
+            close(dumpFd);
+        }
+        mapFd = dumpFd = -1;
+        dumpMarker = NULL;
+        filesPid = pid;
+        
+        char path[64];
+        VMPI_snprintf(path, sizeof(path), "/tmp/perf-%d.map", int(pid));
+        mapFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        if (mapFd < 0) {
+            perror(path);
+            return false;
+        }
+        
+#ifdef __linux__
+        if (wantDump) {
+            VMPI_snprintf(path, sizeof(path), "/tmp/jit-%d.dump", int(pid));
+            dumpFd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (dumpFd < 0) {
+                perror(path);
+                return true;    // The map alone still helps
+            }
+            JitDumpHeader h;
+            VMPI_memset(&h, 0, sizeof(h));
+            h.magic = kJitDumpMagic;
+            h.version = 1;
+            h.total_size = sizeof(h);
+            h.elf_mach = elfMachine();
+            h.pid = uint32_t(pid);
+            h.timestamp = monotonicNs();
+            if (write(dumpFd, &h, sizeof(h)) != ssize_t(sizeof(h))) {
+                perror(path);
+                close(dumpFd);
+                dumpFd = -1;
+                return true;
+            }
+            // perf record finds the dump by this executable mapping of it.
+            dumpMarker = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC, MAP_PRIVATE, dumpFd, 0);
+            if (dumpMarker == MAP_FAILED) {
+                perror(path);
+                dumpMarker = NULL;
+            }
+        }
+#endif
+        return true;
+    }
+    
+    // How much of [start, start + size) is mapped, page by page, so that
+    // copying the code for jitdump can't fault on a guessed size.
+    static size_t mappedPrefix(uintptr_t start, size_t size)
+    {
+        uintptr_t pageSize = uintptr_t(sysconf(_SC_PAGESIZE));
+        uintptr_t end = start + size;
+        for (uintptr_t page = start & ~(pageSize - 1); page < end; page += pageSize) {
+#ifdef __linux__
+            unsigned char resident;
+#else
+            char resident;
+#endif
+            if (mincore((void*)page, pageSize, &resident) < 0 && errno == ENOMEM)
+                return page > start ? size_t(page - start) : 0;
+        }
+        return size;
+    }
+    
+    static int byStart(const void* a, const void* b)
+    {
+        uintptr_t x = *(const uintptr_t*)a, y = *(const uintptr_t*)b;
+        return x < y ? -1 : x > y ? 1 : 0;
+    }
+    
+    // Merges n new starts, sorted, into codeStarts.  Call under files_lock.
+    static void addStarts(const uintptr_t* starts, size_t n)
+    {
+        if (numStarts + n > maxStarts) {
+            maxStarts = 2 * (numStarts + n);
+            uintptr_t* grown = (uintptr_t*)VMPI_alloc(maxStarts * sizeof(uintptr_t));
+            if (numStarts > 0)
+                VMPI_memcpy(grown, codeStarts, numStarts * sizeof(uintptr_t));
+            VMPI_free(codeStarts);
+            codeStarts = grown;
+        }
+        size_t i = numStarts, j = n, k = numStarts + n;
+        while (j > 0) {
+            uintptr_t next = starts[j - 1];
+            if (i > 0 && codeStarts[i - 1] > next)
+                codeStarts[--k] = codeStarts[--i];
+            else {
+                codeStarts[--k] = next;
+                j--;
+            }
+        }
+        numStarts += n;
+    }
+    
+    // The distance from start to the next method written above it, at
+    // most kMaxCodeSize.  Call under files_lock.
+    static size_t codeSize(uintptr_t start)
+    {
+        size_t lo = 0, hi = numStarts;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (codeStarts[mid] <= start)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo < numStarts && codeStarts[lo] - start < kMaxCodeSize)
+            return codeStarts[lo] - start;
+        return kMaxCodeSize;
+    }
+    
+    JitMap::JitMap()
+    : since(monotonicNs())
+    , written(NULL)
+    , capacity(0)
+    , count(0)
+    {
+    }
+    
+    JitMap::~JitMap()
+    {
+        VMPI_free(written);
+    }
+    
+    void JitMap::begin()
+    {
+        since = monotonicNs();
+    }
+    
+    // True the first time for a method at an address.
+    bool JitMap::markWritten(avmplus::MethodInfo* m, uintptr_t start)
+    {
+        if (2 * (count + 1) > capacity) {
+            uint32_t oldCapacity = capacity;
+            Written* old = written;
+            capacity = capacity ? 2 * capacity : 256;
+            written = (Written*)VMPI_alloc(capacity * sizeof(Written));
+            VMPI_memset(written, 0, capacity * sizeof(Written));
+            count = 0;
+            for (uint32_t i=0 ; i < oldCapacity ; i++)
+                if (old[i].method != NULL)
+                    markWritten(old[i].method, old[i].start);
+            VMPI_free(old);
+        }
+        
+        uint32_t i = uint32_t((start >> 4) ^ (uintptr_t(m) >> 3)) & (capacity - 1);
+        for (;;) {
+            Written& w = written[i];
+            if (w.method == NULL) {
+                w.method = m;
+                w.start = start;
+                count++;
+                return true;
+            }
+            if (w.method == m && w.start == start)
+                return false;
+            i = (i + 1) & (capacity - 1);
+        }
+    }
+    
+    void JitMap::scan(avmplus::PoolObject* pool)
+    {
+#ifdef VMCFG_NANOJIT
+        uint32_t n = pool->methodCount();
+        Entry* entries = NULL;
+        uint32_t numEntries = 0;
+        for (uint32_t i=0 ; i < n ; i++) {
+            avmplus::MethodInfo* m = pool->getMethodInfo(i);
+            if (m == NULL || !m->isJitImpl())
+                continue;
+            uintptr_t start = uintptr_t(m->implGPR());
+            if (!markWritten(m, start))
+                continue;
+            if (entries == NULL)
+                entries = new Entry[n];
+            entries[numEntries].start = start;
+            entries[numEntries].method = m;
+            numEntries++;
+        }
+        if (numEntries == 0)
+            return;
+        qsort(entries, numEntries, sizeof(Entry), byStart);
+        
+#ifdef __linux__
+        uint32_t tid = uint32_t(syscall(SYS_gettid));
+#else
+        uint32_t tid = uint32_t(getpid());
+#endif
+        // One write per file for the lot.
+        size_t mapLen = 0, dumpLen = 0;
+        char* mapBuf = NULL;
+        uint8_t* dumpBuf = NULL;
+        SCOPE_LOCK(files_lock) {
+            if (!openFiles()) {
+                delete [] entries;
+                return;
+            }
+            
+            // Sized against what every core has written, these included.
+            uintptr_t* starts = new uintptr_t[numEntries];
+            for (uint32_t i=0 ; i < numEntries ; i++)
+                starts[i] = entries[i].start;
+            addStarts(starts, numEntries);
+            delete [] starts;
+            size_t total = 0;
+            for (uint32_t i=0 ; i < numEntries ; i++) {
+                Entry& e = entries[i];
+                e.size = mappedPrefix(e.start, codeSize(e.start));
+                total += sizeof(JitCodeLoad) + 512 + e.size;
+            }
+            mapBuf = (char*)VMPI_alloc(numEntries * 600);
+            if (wantDump && dumpFd >= 0)
+                dumpBuf = (uint8_t*)VMPI_alloc(total);
+            
+            for (uint32_t i=0 ; i < numEntries ; i++) {
+                Entry& e = entries[i];
+                if (e.size == 0)
+                    continue;
+                
+                char name[512];
+#ifdef VMCFG_METHOD_NAMES
+                avmplus::StUTF8String s(e.method->getMethodName());
+                VMPI_snprintf(name, sizeof(name), "%s", s.c_str());
+#else
+                VMPI_snprintf(name, sizeof(name), "method_%d", e.method->method_id());
+#endif
+                mapLen += VMPI_snprintf(mapBuf + mapLen, 600, "%lx %lx %s\n",
+                                        (unsigned long)e.start, (unsigned long)e.size, name);
+                
+                if (dumpBuf != NULL) {
+                    size_t nameLen = VMPI_strlen(name) + 1;
+                    JitCodeLoad r;
+                    r.id = kJitCodeLoad;
+                    r.total_size = uint32_t(sizeof(r) + nameLen + e.size);
+                    r.timestamp = since;
+                    r.pid = uint32_t(filesPid);
+                    r.tid = tid;
+                    r.vma = r.code_addr = e.start;
+                    r.code_size = e.size;
+                    r.code_index = codeIndex++;
+                    VMPI_memcpy(dumpBuf + dumpLen, &r, sizeof(r));
+                    VMPI_memcpy(dumpBuf + dumpLen + sizeof(r), name, nameLen);
+                    VMPI_memcpy(dumpBuf + dumpLen + sizeof(r) + nameLen, (const void*)e.start, e.size);
+                    dumpLen += r.total_size;
+                }
+                numMethods++;
+                numBytes += e.size;
+            }
+            if (write(mapFd, mapBuf, mapLen) != ssize_t(mapLen))
+                perror("perf map");
+            if (dumpLen > 0 && write(dumpFd, dumpBuf, dumpLen) != ssize_t(dumpLen))
+                perror("jitdump");
+        }
+        VMPI_free(mapBuf);
+        VMPI_free(dumpBuf);
+        delete [] entries;
+#endif
+    }
+    
+    /* static */
+    bool JitMap::init(bool jitdump)
+    {
+#ifndef VMCFG_NANOJIT
+        fprintf(stderr, "-perf-map: no JIT in this build\n");
+        return false;
+#else
+#ifndef __linux__
+        if (jitdump)
+            fprintf(stderr, "-perf-map=jitdump: perf is Linux only, writing the map alone\n");
+        jitdump = false;
+#endif
+        wantDump = jitdump;
+        SCOPE_LOCK(files_lock) {
+            return openFiles();
+        }
+        return false;
+#endif
+    }
+    
+    /* static */
+    void JitMap::report(FILE* f)
+    {
+        SCOPE_LOCK(files_lock) {
+            if (filesPid != 0)
+                fprintf(f, "perf map: %lu jitted methods, %llu KB, in /tmp/perf-%d.map%s\n",
+                        numMethods, (unsigned long long)(numBytes / 1024), int(filesPid),
+                        dumpFd >= 0 ? " and a jitdump" : "");
+        }
+    }
+}
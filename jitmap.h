@@ -0,0 +1,76 @@
+#ifndef assh_jitmap_h
+#define assh_jitmap_h
+
+#include <stdio.h>
+
+#include "avmshell.h"
+
+namespace avmshell
+{
+    // -perf-map[=jitdump]: tells Linux perf where the JIT put each method,
+    // so samples in jitted code get AS3 names instead of bare addresses.
+    // Every method a core has jitted goes to /tmp/perf-<pid>.map, one
+    // "START SIZE name" line each; with =jitdump, a code load record with
+    // a copy of the code also goes to /tmp/jit-<pid>.dump, for
+    // "perf record -k mono" and "perf inject --jit".
+    //
+    // The JIT leaves no record of what it made and has no hook the shell
+    // can reach, so after every evaluation the core hands the map the
+    // pools parsed since the last one, from its list of live pools, and
+    // the builtin and shell pools.  Each pool is scanned once, for the
+    // jitted methods not written yet; only the builtin and shell ones,
+    // which live as long as the core, are scanned every time.  No pool is
+    // kept alive for the map.  A method jitted in a later evaluation than
+    // the one that parsed its pool is not seen.
+    //
+    // Sizes are not known either.  The JIT emits a chunk's code from the
+    // top down, so a method ends where the next method above it starts;
+    // the map takes the nearest jitted method of any pool or core seen so
+    // far, capped at 64 KB and trimmed to mapped pages.  The topmost
+    // method of a chunk can still run on past its end.  Cores scan on their
+    // own threads; only the writes, a batch at a time, are shared.
+    class JitMap
+    {
+    public:
+        JitMap();
+        ~JitMap();
+        
+        // Stamps the jitdump records of the next scans.  perf only names a
+        // sample with code loaded before it, so call as the evaluation
+        // starts, not after: the methods are jitted while it runs.
+        void begin();
+        
+        // Writes the pool's jitted methods not written yet.  Call on the
+        // core's thread with its GC entered.
+        void scan(avmplus::PoolObject* pool);
+        
+        // Once, before any core starts; false if the files can't be made.
+        static bool init(bool jitdump);
+        static void report(FILE* f);
+        
+    private:
+        struct Entry
+        {
+            uintptr_t               start;
+            size_t                  size;
+            avmplus::MethodInfo*    method;
+        };
+        
+        bool markWritten(avmplus::MethodInfo* m, uintptr_t start);
+        
+        uint64_t                since;      // Timestamp for the next scans' records
+        
+        // What this core has written, by method and address: open
+        // addressing, grown at half full.
+        struct Written
+        {
+            avmplus::MethodInfo*    method;
+            uintptr_t               start;
+        };
+        Written*                written;
+        uint32_t                capacity;
+        uint32_t                count;
+    };
+}
+
+#endif
@@ -0,0 +1,218 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "jobsource.h"
+
+static const char *source_path = NULL;
+static FILE       *lines = NULL;        // stdin or the FIFO
+static bool        reopen = false;      // a FIFO: wait for the next writer at EOF
+static bool        spool = false;
+static bool        done = false;
+static unsigned long jobs_read = 0;
+
+#ifdef __linux__
+static int         notify_fd = -1;
+static char        events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+static ssize_t     events_len = 0;
+static ssize_t     events_pos = 0;
+#else
+// Without inotify the spool is rescanned every kPollMs for names not
+// seen before.
+static const int   kPollMs = 100;
+static char      **seen = NULL;
+static int         numseen = 0;
+static char      **pending = NULL;      // New this scan, in directory order
+static int         numpending = 0;
+static int         nextpending = 0;
+
+static bool was_seen( const char *name ) {
+    for ( int i=0 ; i < numseen ; i++ )
+        if ( strcmp( seen[i], name ) == 0 )
+            return true;
+    return false;
+}
+
+// Reads the spool, returning the names not seen before and, with record,
+// remembering them.
+static void scan_spool( bool record ) {
+    DIR *dir = opendir( source_path );
+    if ( !dir ) {
+        perror( source_path );
+        done = true;
+        return;
+    }
+    struct dirent *de;
+    while ( ( de = readdir( dir ) ) != NULL ) {
+        if ( de->d_name[0] == '.' || was_seen( de->d_name ) )
+            continue;
+        seen = (char **)realloc( seen, ( numseen + 1 ) * sizeof(char *) );
+        seen[numseen++] = strdup( de->d_name );
+        if ( record ) {
+            pending = (char **)realloc( pending, ( numpending + 1 ) * sizeof(char *) );
+            pending[numpending++] = seen[numseen - 1];
+        }
+    }
+    closedir( dir );
+}
+#endif
+
+bool job_source_open( const char *spec ) {
+    source_path = spec;
+    if ( strcmp( spec, "-" ) == 0 ) {
+        lines = stdin;
+        return true;
+    }
+
+    struct stat st;
+    if ( stat( spec, &st ) < 0 ) {
+        perror( spec );
+        return false;
+    }
+    if ( S_ISDIR( st.st_mode ) ) {
+        spool = true;
+#ifdef __linux__
+        notify_fd = inotify_init();
+        if ( notify_fd < 0 || inotify_add_watch( notify_fd, spec, IN_CLOSE_WRITE | IN_MOVED_TO ) < 0 ) {
+            perror( spec );
+            return false;
+        }
+#else
+        scan_spool( false );    // Only what arrives from now on
+#endif
+        return true;
+    }
+
+    reopen = S_ISFIFO( st.st_mode );
+    lines = fopen( spec, "r" );
+    if ( !lines ) {
+        perror( spec );
+        return false;
+    }
+    return true;
+}
+
+// The path for a name in the spool, or NULL if it ends the stream.
+static char *spooled( const char *name ) {
+    if ( name[0] == '.' )
+        return (char *)"";
+    if ( strcmp( name, "QUIT" ) == 0 ) {
+        done = true;
+        return NULL;
+    }
+    char *path = (char *)malloc( strlen( source_path ) + strlen( name ) + 2 );
+    sprintf( path, "%s/%s", source_path, name );
+    return path;
+}
+
+static char *next_spooled() {
+    for (;;) {
+#ifdef __linux__
+        if ( events_pos >= events_len ) {
+            events_len = read( notify_fd, events, sizeof(events) );
+            events_pos = 0;
+            if ( events_len < 0 && errno == EINTR )
+                continue;
+            if ( events_len <= 0 ) {
+                perror( source_path );
+                done = true;
+                return NULL;
+            }
+        }
+        struct inotify_event *ev = (struct inotify_event *)( events + events_pos );
+        events_pos += sizeof(struct inotify_event) + ev->len;
+        if ( ev->len == 0 )
+            continue;
+        char *path = spooled( ev->name );
+#else
+        if ( nextpending == numpending ) {
+            numpending = nextpending = 0;
+            scan_spool( true );
+            if ( numpending == 0 && !done )
+                usleep( kPollMs * 1000 );
+            if ( done )
+                return NULL;
+            continue;
+        }
+        char *path = spooled( pending[nextpending++] );
+#endif
+        if ( path == NULL || *path )
+            return path;
+    }
+}
+
+static char *next_line() {
+    char *line = NULL;
+    size_t size = 0;
+    for (;;) {
+        ssize_t len = getline( &line, &size, lines );
+        if ( len < 0 ) {
+            if ( !reopen || ferror( lines ) ) {
+                done = true;
+                break;
+            }
+            // The last writer has gone; block until the next one opens it.
+            fclose( lines );
+            lines = fopen( source_path, "r" );
+            if ( !lines ) {
+                perror( source_path );
+                done = true;
+                break;
+            }
+            continue;
+        }
+        while ( len > 0 && ( line[len - 1] == '\n' || line[len - 1] == '\r' ) )
+            line[--len] = 0;
+        if ( len == 0 )
+            continue;
+        if ( strcmp( line, "QUIT" ) == 0 ) {
+            done = true;
+            break;
+        }
+        return line;
+    }
+    free( line );
+    return NULL;
+}
+
+char *job_source_next() {
+    if ( done )
+        return NULL;
+    char *path = spool ? next_spooled() : next_line();
+    if ( path )
+        jobs_read++;
+    return path;
+}
+
+void job_source_close() {
+    if ( lines && lines != stdin )
+        fclose( lines );
+    lines = NULL;
+#ifdef __linux__
+    if ( notify_fd >= 0 )
+        close( notify_fd );
+    notify_fd = -1;
+#else
+    for ( int i=0 ; i < numseen ; i++ )
+        free( seen[i] );
+    free( seen );
+    free( pending );
+    seen = pending = NULL;
+    numseen = numpending = nextpending = 0;
+#endif
+}
+
+void job_source_report() {
+    if ( source_path )
+        fprintf( stderr, "jobs: %lu read from %s\n", jobs_read, source_path );
+}
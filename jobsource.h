@@ -0,0 +1,29 @@
+#ifndef assh_jobsource_h
+#define assh_jobsource_h
+
+// -jobs SOURCE: an unbounded stream of script paths for the worker pool,
+// which stays up and dispatches each one as soon as a thread and core are
+// free, instead of running a fixed list of files and shutting down.
+//
+//   -jobs -        one path per line on stdin, until end of input
+//   -jobs FIFO     one path per line; reopened whenever the last writer
+//                  closes it, so producers may come and go
+//   -jobs DIR      a spool directory: every file moved or written into it
+//                  after startup is a job (dotfiles are ignored, so write
+//                  aside and rename); files are left for the producer to
+//                  clean up
+//
+// A line, or a spooled file name, reading QUIT ends the stream; the pool
+// finishes the jobs it has and exits.
+
+bool job_source_open( const char *spec );
+
+// Blocks for the next path, returned malloc'd.  NULL at the end of the
+// stream.  Called from the master thread only.
+char *job_source_next();
+
+void job_source_close();
+
+void job_source_report();
+
+#endif
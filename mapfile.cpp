@@ -0,0 +1,95 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mapfile.h"
+
+struct Mapping : MappedFile {
+    dev_t    dev;
+    ino_t    ino;
+    time_t   mtime;
+    int      refs;
+    Mapping *next;
+};
+
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+static Mapping        *mappings = NULL;
+static unsigned long   map_count = 0;      // files mapped
+static unsigned long   map_shared = 0;     // loads served by an existing mapping
+static unsigned long   map_bytes = 0;      // bytes mapped, all told
+
+MappedFile *map_file( const char *filename ) {
+    int fd = open( filename, O_RDONLY );
+    struct stat st;
+    if ( fd < 0 )
+        return NULL;
+    if ( fstat( fd, &st ) < 0 || !S_ISREG( st.st_mode ) || st.st_size == 0 ) {
+        close( fd );
+        return NULL;
+    }
+
+    pthread_mutex_lock( &map_lock );
+
+    Mapping *m;
+    for ( m = mappings ; m != NULL ; m = m->next ) {
+        if ( m->dev == st.st_dev && m->ino == st.st_ino &&
+             m->size == (size_t)st.st_size && m->mtime == st.st_mtime )
+            break;
+    }
+
+    if ( m != NULL ) {
+        m->refs++;
+        map_shared++;
+    }
+    else {
+        void *map = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+        if ( map != MAP_FAILED ) {
+            m = new Mapping;
+            m->bytes = (const uint8_t *)map;
+            m->size  = st.st_size;
+            m->dev   = st.st_dev;
+            m->ino   = st.st_ino;
+            m->mtime = st.st_mtime;
+            m->refs  = 1;
+            m->next  = mappings;
+            mappings = m;
+            map_count++;
+            map_bytes += st.st_size;
+        }
+    }
+
+    pthread_mutex_unlock( &map_lock );
+    close( fd );
+    return m;
+}
+
+void unmap_file( MappedFile *file ) {
+    Mapping *m = static_cast<Mapping *>( file );
+
+    pthread_mutex_lock( &map_lock );
+    bool last = --m->refs == 0;
+    if ( last ) {
+        Mapping **p = &mappings;
+        while ( *p != m )
+            p = &(*p)->next;
+        *p = m->next;
+    }
+    pthread_mutex_unlock( &map_lock );
+
+    if ( last ) {
+        munmap( (void *)m->bytes, m->size );
+        delete m;
+    }
+}
+
+void map_report() {
+    pthread_mutex_lock( &map_lock );
+    if ( map_count > 0 )
+        fprintf( stderr, "mapped files: %lu (%lu bytes), %lu loads shared an existing mapping\n",
+                 map_count, map_bytes, map_shared );
+    pthread_mutex_unlock( &map_lock );
+}
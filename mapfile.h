@@ -0,0 +1,26 @@
+#ifndef assh_mapfile_h
+#define assh_mapfile_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Read-only mappings of input files, shared by every core in the process.
+// A file is mapped once per (device, inode, size, mtime); each core that
+// parses from it holds a reference for as long as its pools may point into
+// the bytes.  Files must be replaced (written aside and renamed), never
+// rewritten in place, while a mapping of them is live.
+
+struct MappedFile {
+    const uint8_t *bytes;
+    size_t         size;
+};
+
+// Returns the mapping of filename with a new reference, or NULL if it
+// can't be mapped (missing, empty, not a regular file).
+MappedFile *map_file( const char *filename );
+
+void unmap_file( MappedFile *file );
+
+void map_report();
+
+#endif
@@ -0,0 +1,105 @@
+#include "output.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+static char  *output_buf  = NULL;     // NULL until output_init: unbuffered
+static size_t output_size = 0;
+static size_t output_used = 0;
+static bool   output_line = false;
+
+static const int crash_signals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT, SIGINT, SIGTERM, SIGHUP };
+
+// Like stdio, output that can't be written (closed pipe, full disk) is dropped.
+static void write_iov( struct iovec *iov, int n ) {
+    while ( n > 0 ) {
+        ssize_t r = writev( STDOUT_FILENO, iov, n );
+        if ( r < 0 ) {
+            if ( errno == EINTR )
+                continue;
+            return;
+        }
+        while ( n > 0 && (size_t)r >= iov->iov_len ) {
+            r -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if ( n > 0 ) {
+            iov->iov_base = (char *)iov->iov_base + r;
+            iov->iov_len -= r;
+        }
+    }
+}
+
+static void flush_locked() {
+    if ( output_used ) {
+        struct iovec iov = { output_buf, output_used };
+        write_iov( &iov, 1 );
+        output_used = 0;
+    }
+}
+
+static void flush_at_exit() {
+    output_flush();
+}
+
+// No locking here: whoever held the lock isn't coming back.
+static void flush_on_crash( int sig ) {
+    if ( output_used ) {
+        ssize_t r = write( STDOUT_FILENO, output_buf, output_used );
+        (void)r;
+        output_used = 0;
+    }
+    signal( sig, SIG_DFL );
+    raise( sig );
+}
+
+void output_init( FlushPolicy policy, size_t size ) {
+    if ( policy == FLUSH_AUTO )
+        policy = isatty( STDOUT_FILENO ) ? FLUSH_LINE : FLUSH_BLOCK;
+
+    output_line = policy == FLUSH_LINE;
+    output_size = size ? size : OUTPUT_DEFAULT_SIZE;
+    output_buf  = (char *)malloc( output_size );
+
+    atexit( flush_at_exit );
+    for ( size_t i = 0; i < sizeof(crash_signals) / sizeof(crash_signals[0]); i++ )
+        signal( crash_signals[i], flush_on_crash );
+}
+
+void output_write( const char *bytes, size_t count ) {
+    if ( count == 0 )
+        return;
+
+    pthread_mutex_lock( &output_lock );
+
+    if ( output_used + count <= output_size ) {
+        memcpy( output_buf + output_used, bytes, count );
+        output_used += count;
+        if ( output_line && memchr( bytes, '\n', count ) )
+            flush_locked();
+    }
+    else {
+        // doesn't fit (or unbuffered): one writev for the buffer and the chunk.
+        struct iovec iov[2] = { { output_buf, output_used }, { (void *)bytes, count } };
+        if ( output_used )
+            write_iov( iov, 2 );
+        else
+            write_iov( iov + 1, 1 );
+        output_used = 0;
+    }
+
+    pthread_mutex_unlock( &output_lock );
+}
+
+void output_flush() {
+    pthread_mutex_lock( &output_lock );
+    flush_locked();
+    pthread_mutex_unlock( &output_lock );
+}
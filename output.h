@@ -0,0 +1,25 @@
+#ifndef assh_output_h
+#define assh_output_h
+
+#include <stddef.h>
+
+// Process-wide buffered stdout behind ConsoleOutputStream.  Writes are
+// length-based (no format parsing) and go out with writev, so a chunk that
+// doesn't fit the buffer is sent together with what is already buffered,
+// in one call and without being copied.
+
+enum FlushPolicy
+{
+    FLUSH_AUTO,     // FLUSH_LINE on a tty, FLUSH_BLOCK otherwise
+    FLUSH_LINE,     // flush after any write that contains a newline
+    FLUSH_BLOCK     // flush only when the buffer fills, and on exit
+};
+
+#define OUTPUT_DEFAULT_SIZE (64 * 1024)
+
+// Flushes at exit and, best effort, on fatal signals.
+void output_init( FlushPolicy policy, size_t size );
+void output_write( const char *bytes, size_t count );
+void output_flush();
+
+#endif
@@ -0,0 +1,262 @@
+#include "shell.h"
+#include "profiler.h"
+#include "asshcore.h"
+
+namespace avmshell
+{
+    // Raises an interrupt on the active cores in turn, ticking at the rate
+    // of the fastest profiler and skipping ticks for the slower ones.
+    // Started with the first profiler and joined when the last one goes;
+    // in between it only wakes to sample while some core is evaluating.
+    class SamplerThread : public vmbase::VMThread
+    {
+    public:
+        SamplerThread() : stopping(false) {}
+        
+        virtual void run();
+        
+        bool stopping;          // Under sampler_monitor
+    };
+    
+    static vmbase::WaitNotifyMonitor    sampler_monitor;
+    static SamplerThread*               sampler = NULL;         // Under sampler_monitor
+    static Profiler*                    profilers = NULL;       // Likewise
+    static int                          numActive = 0;          // Likewise
+    static int                          samplerHz = 0;          // Likewise: the fastest asked for
+    
+    static vmbase::RecursiveMutex       totals_lock;
+    static Profiler::Stack*             totals[Profiler::kBuckets]; // Under totals_lock
+    
+    void SamplerThread::run()
+    {
+        SCOPE_LOCK_NAMED(locker, sampler_monitor) {
+            while (!stopping) {
+                if (numActive == 0) {
+                    locker.wait();
+                    continue;
+                }
+                int32_t ms = 1000 / samplerHz;
+                locker.wait(ms > 0 ? ms : 1);
+                for (Profiler* p = profilers; p != NULL; p = p->next) {
+                    if (!p->active || (p->credit += p->hz) < samplerHz)
+                        continue;
+                    p->credit -= samplerHz;
+                    if (!p->core->samplePending) {
+                        p->core->samplePending = true;
+                        p->core->raiseInterrupt(avmplus::AvmCore::ExternalInterrupt);
+                    }
+                }
+            }
+        }
+    }
+    
+    Profiler::Profiler(AsshCore* core, int hz)
+    : core(core)
+    , hz(hz)
+    , active(false)
+    , next(NULL)
+    , credit(0)
+    , numSamples(0)
+    , buf((char*)VMPI_alloc(kMaxFolded))
+    {
+        VMPI_memset(stacks, 0, sizeof(stacks));
+        SCOPE_LOCK(sampler_monitor) {
+            next = profilers;
+            profilers = this;
+            if (hz > samplerHz)
+                samplerHz = hz;
+            if (sampler == NULL) {
+                sampler = new SamplerThread;
+                sampler->start();
+            }
+        }
+    }
+    
+    Profiler::~Profiler()
+    {
+        SamplerThread* done = NULL;
+        SCOPE_LOCK_NAMED(locker, sampler_monitor) {
+            if (active)
+                numActive--;
+            Profiler** p = &profilers;
+            while (*p != this)
+                p = &(*p)->next;
+            *p = next;
+            samplerHz = 0;
+            for (Profiler* q = profilers; q != NULL; q = q->next)
+                if (q->hz > samplerHz)
+                    samplerHz = q->hz;
+            if (profilers == NULL) {
+                // The last one; a new profiler starts a new sampler.
+                done = sampler;
+                sampler = NULL;
+                done->stopping = true;
+                locker.notifyAll();
+            }
+        }
+        if (done != NULL) {
+            done->join();
+            delete done;
+        }
+        SCOPE_LOCK(totals_lock) {
+            for (int b=0 ; b < kBuckets ; b++)
+                for (Stack* s = stacks[b]; s != NULL; s = s->next)
+                    count(totals, s->folded, s->count);
+        }
+        clear(stacks);
+        VMPI_free(buf);
+    }
+    
+    void Profiler::start()
+    {
+        SCOPE_LOCK_NAMED(locker, sampler_monitor) {
+            if (!active) {
+                active = true;
+                numActive++;
+                locker.notifyAll();
+            }
+        }
+    }
+    
+    void Profiler::stop()
+    {
+        SCOPE_LOCK(sampler_monitor) {
+            if (active) {
+                active = false;
+                numActive--;
+            }
+        }
+    }
+    
+    void Profiler::sample()
+    {
+        bool sampling = false;
+        SCOPE_LOCK(sampler_monitor) {
+            sampling = active;
+        }
+        if (!sampling)
+            return;     // Raised just before stop()
+        
+        // Frames come innermost first; the folded stack wants them
+        // outermost first, so fill buf from the end.  A stack too deep for
+        // it loses its outermost frames.
+        size_t pos = kMaxFolded - 1;
+        buf[pos] = 0;
+        for (avmplus::MethodFrame* f = core->currentMethodFrame; f != NULL; f = f->next) {
+            avmplus::MethodEnv* env = f->env();
+            if (env == NULL)
+                continue;       // A code context, not a method
+            avmplus::MethodInfo* m = env->method;
+            
+            char frame[512];
+#ifdef VMCFG_METHOD_NAMES
+            avmplus::StUTF8String name(m->getMethodName());
+            int len = VMPI_snprintf(frame, sizeof(frame) - 32, "%s", name.c_str());
+#else
+            int len = VMPI_snprintf(frame, sizeof(frame) - 32, "method_%d", m->method_id());
+#endif
+            if (len > int(sizeof(frame)) - 33)
+                len = int(sizeof(frame)) - 33;
+            // The folded format has no quoting; keep its separators out of names.
+            for (int i=0 ; i < len ; i++)
+                if (frame[i] == ' ' || frame[i] == ';')
+                    frame[i] = '_';
+            const char* kind = m->isNative() ? "native" :
+#ifdef VMCFG_NANOJIT
+                               m->isJitImpl() ? "jit" :
+#endif
+                               "interp";
+            len += VMPI_snprintf(frame + len, sizeof(frame) - len, "_[%s]%s", kind, pos < kMaxFolded - 1 ? ";" : "");
+            
+            if (size_t(len) > pos)
+                break;
+            pos -= len;
+            VMPI_memcpy(buf + pos, frame, len);
+        }
+        if (pos == kMaxFolded - 1)
+            return;     // No AS3 frames
+        
+        count(stacks, buf + pos, 1);
+        numSamples++;
+    }
+    
+    /* static */
+    void Profiler::count(Stack** table, const char* folded, int n)
+    {
+        uint32_t h = 2166136261u;
+        for (const char* p = folded; *p; p++)
+            h = (h ^ uint8_t(*p)) * 16777619u;
+        Stack** bucket = &table[h % kBuckets];
+        
+        for (Stack* s = *bucket; s != NULL; s = s->next) {
+            if (VMPI_strcmp(s->folded, folded) == 0) {
+                s->count += n;
+                return;
+            }
+        }
+        Stack* s = new Stack;
+        size_t len = VMPI_strlen(folded);
+        s->folded = (char*)VMPI_alloc(len + 1);
+        VMPI_memcpy(s->folded, folded, len + 1);
+        s->count = n;
+        s->next = *bucket;
+        *bucket = s;
+    }
+    
+    static int byCount(const void* a, const void* b)
+    {
+        int x = (*(Profiler::Stack* const*)a)->count, y = (*(Profiler::Stack* const*)b)->count;
+        return y - x;
+    }
+    
+    /* static */
+    void Profiler::write(FILE* f, Stack** table, int limit)
+    {
+        int n = 0;
+        for (int b=0 ; b < kBuckets ; b++)
+            for (Stack* s = table[b]; s != NULL; s = s->next)
+                n++;
+        Stack** sorted = new Stack*[n > 0 ? n : 1];
+        n = 0;
+        for (int b=0 ; b < kBuckets ; b++)
+            for (Stack* s = table[b]; s != NULL; s = s->next)
+                sorted[n++] = s;
+        qsort(sorted, n, sizeof(Stack*), byCount);
+        
+        for (int i=0 ; i < n && (limit == 0 || i < limit) ; i++)
+            fprintf(f, "%s %d\n", sorted[i]->folded, sorted[i]->count);
+        delete [] sorted;
+    }
+    
+    /* static */
+    void Profiler::clear(Stack** table)
+    {
+        for (int b=0 ; b < kBuckets ; b++) {
+            while (table[b] != NULL) {
+                Stack* s = table[b];
+                table[b] = s->next;
+                VMPI_free(s->folded);
+                delete s;
+            }
+        }
+    }
+    
+    void Profiler::print(FILE* f, int limit)
+    {
+        write(f, stacks, limit);
+    }
+    
+    /* static */
+    void Profiler::report(const char* path)
+    {
+        SCOPE_LOCK(totals_lock) {
+            FILE* f = fopen(path, "w");
+            if (f == NULL) {
+                perror(path);
+                return;
+            }
+            write(f, totals, 0);
+            fclose(f);
+        }
+    }
+}
@@ -0,0 +1,80 @@
+#ifndef assh_profiler_h
+#define assh_profiler_h
+
+#include <stdio.h>
+
+#include "avmshell.h"
+
+namespace avmshell
+{
+    class AsshCore;
+    
+    // A sampling profiler for the AS3 code one core runs.  One sampler
+    // thread for the whole process raises an interrupt on every core that
+    // is evaluating something, hz times a second; the core takes the
+    // sample itself, at its next interrupt check, by walking its method
+    // frames.  So samples land only where code checks for interrupts
+    // (loop edges and calls, with -Dinterrupts on when the code was
+    // compiled), and a core stopped in native code is sampled once it
+    // comes back.
+    //
+    // Samples are counted by stack, in flamegraph's folded format: frames
+    // from the outermost in, separated by ';', each tagged _[interp],
+    // _[jit] or _[native] by how the method runs, and a count.  -profile
+    // FILE writes the counts of every core at exit; .profile prints those
+    // of one evaluation in the REPL.
+    class Profiler
+    {
+    public:
+        Profiler(AsshCore* core, int hz);
+        ~Profiler();            // Adds this core's counts to the totals
+        
+        // Bracket one evaluation; the core is only sampled in between.
+        void start();
+        void stop();
+        
+        // Called on the core's thread from its interrupt handler, when the
+        // interrupt was the sampler's.
+        void sample();
+        
+        // This core's stacks, most samples first, at most limit of them
+        // (0 for all).
+        void print(FILE* f, int limit);
+        
+        int samples() const { return numSamples; }
+        
+        // Process totals, once the cores are gone.
+        static void report(const char* path);
+        
+        static const int kDefaultHz = 1000;
+        
+        struct Stack
+        {
+            char*   folded;
+            int     count;
+            Stack*  next;
+        };
+        
+        static const int kBuckets = 1024;
+        
+    private:
+        static const size_t kMaxFolded = 16 * 1024;
+        
+        static void count(Stack** table, const char* folded, int n);
+        static void write(FILE* f, Stack** table, int limit);
+        static void clear(Stack** table);
+        
+        friend class SamplerThread;
+        
+        AsshCore* const core;
+        const int       hz;
+        bool            active;     // Under the sampler's monitor
+        Profiler*       next;       // In the sampler's list
+        int             credit;     // Likewise: toward its next sample, in hz per sampler tick
+        Stack*          stacks[kBuckets];
+        int             numSamples;
+        char*           buf;        // Where sample() builds a stack
+    };
+}
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef assh_samples_h
+#define assh_samples_h
+
+namespace avmshell
+{
+    // A fixed buffer of samples over time that never fills: every sample
+    // offered is kept until the buffer is full; then every other sample is
+    // dropped and from then on only every other one offered is kept, and
+    // so on.  The samples left are evenly spaced over the whole run.  Not
+    // locked; its owner's lock covers it.
+    template <class T, int N>
+    class DecimatingSamples
+    {
+    public:
+        DecimatingSamples() : count(0), stride(1), skip(0) {}
+        
+        // Where to write the sample being offered, or NULL to skip it.
+        T* next()
+        {
+            if (++skip < stride)
+                return NULL;
+            skip = 0;
+            
+            if (count == N) {
+                for (int i=0 ; i < N / 2 ; i++)
+                    samples[i] = samples[2 * i + 1];
+                count = N / 2;
+                stride *= 2;
+            }
+            return &samples[count++];
+        }
+        
+        int size() const { return count; }
+        const T& operator[](int i) const { return samples[i]; }
+        
+    private:
+        T       samples[N];
+        int     count;
+        int     stride;         // Offers per sample kept
+        int     skip;           // Offers since the last one kept
+    };
+}
+
+#endif
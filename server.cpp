@@ -0,0 +1,162 @@
+#include "server.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static int socket_address( const char *path, struct sockaddr_un *addr ) {
+    if ( strlen( path ) >= sizeof(addr->sun_path) ) {
+        fprintf( stderr, "%s: socket path too long\n", path );
+        return -1;
+    }
+
+    memset( addr, 0, sizeof(*addr) );
+    addr->sun_family = AF_UNIX;
+    strcpy( addr->sun_path, path );
+    return 0;
+}
+
+// Returns a listening socket bound to path, replacing any stale socket
+// left behind by a previous server, or -1.
+int server_listen( const char *path ) {
+    struct sockaddr_un addr;
+    if ( socket_address( path, &addr ) < 0 )
+        return -1;
+
+    int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if ( fd < 0 ) {
+        perror( "socket" );
+        return -1;
+    }
+
+    unlink( path );
+    if ( bind( fd, (struct sockaddr *)&addr, sizeof(addr) ) < 0 || listen( fd, 64 ) < 0 ) {
+        perror( path );
+        close( fd );
+        return -1;
+    }
+
+    return fd;
+}
+
+int server_connect( const char *path ) {
+    struct sockaddr_un addr;
+    if ( socket_address( path, &addr ) < 0 )
+        return -1;
+
+    int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if ( fd < 0 ) {
+        perror( "socket" );
+        return -1;
+    }
+
+    if ( connect( fd, (struct sockaddr *)&addr, sizeof(addr) ) < 0 ) {
+        perror( path );
+        close( fd );
+        return -1;
+    }
+
+    return fd;
+}
+
+// Reads one '\n'-terminated header line (without the '\n') into buf.
+// Headers are short, so this reads a byte at a time rather than risk
+// consuming the payload behind them.  Returns the length, or -1.
+int read_line( int fd, char *buf, size_t size ) {
+    size_t n = 0;
+
+    while ( n + 1 < size ) {
+        ssize_t r = read( fd, buf + n, 1 );
+        if ( r < 0 && errno == EINTR )
+            continue;
+        if ( r <= 0 )
+            return -1;
+        if ( buf[n] == '\n' ) {
+            buf[n] = 0;
+            return (int)n;
+        }
+        n++;
+    }
+
+    return -1;
+}
+
+// read_line for a nonblocking socket: adds what has arrived of the header
+// line to buf, which holds *len bytes of it so far, without consuming
+// anything past the '\n'.  Returns 1 with the line in buf (without the
+// '\n') once it is complete, 0 if more is to come, or -1.
+int read_header( int fd, char *buf, size_t size, size_t *len ) {
+    if ( *len + 1 >= size )
+        return -1;
+
+    ssize_t r = recv( fd, buf + *len, size - 1 - *len, MSG_PEEK );
+    if ( r < 0 && ( errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK ) )
+        return 0;
+    if ( r <= 0 )
+        return -1;
+
+    char *nl = (char *)memchr( buf + *len, '\n', r );
+    size_t take = nl ? size_t( nl - ( buf + *len ) ) + 1 : size_t(r);
+    if ( read_all( fd, buf + *len, take ) < 0 )
+        return -1;
+    *len += take;
+    if ( !nl )
+        return *len + 1 >= size ? -1 : 0;
+
+    buf[*len - 1] = 0;
+    return 1;
+}
+
+// Makes blocking reads on fd fail with EAGAIN after ms without data.
+int set_read_timeout( int fd, int ms ) {
+    struct timeval tv;
+    tv.tv_sec  = ms / 1000;
+    tv.tv_usec = ( ms % 1000 ) * 1000;
+    return setsockopt( fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv) );
+}
+
+int read_all( int fd, char *buf, size_t count ) {
+    while ( count > 0 ) {
+        ssize_t r = read( fd, buf, count );
+        if ( r < 0 && errno == EINTR )
+            continue;
+        if ( r <= 0 )
+            return -1;
+        buf   += r;
+        count -= r;
+    }
+    return 0;
+}
+
+int write_all( int fd, const char *buf, size_t count ) {
+    while ( count > 0 ) {
+        ssize_t r = write( fd, buf, count );
+        if ( r < 0 && errno == EINTR )
+            continue;
+        if ( r < 0 )
+            return -1;
+        buf   += r;
+        count -= r;
+    }
+    return 0;
+}
+
+int send_output( int fd, const char *bytes, size_t count ) {
+    char header[32];
+    int len = snprintf( header, sizeof(header), "O %lu\n", (unsigned long)count );
+
+    if ( write_all( fd, header, len ) < 0 )
+        return -1;
+    return write_all( fd, bytes, count );
+}
+
+int send_exit( int fd, int code ) {
+    char header[32];
+    int len = snprintf( header, sizeof(header), "X %d\n", code );
+
+    return write_all( fd, header, len );
+}
@@ -0,0 +1,34 @@
+#ifndef assh_server_h
+#define assh_server_h
+
+#include <stddef.h>
+
+// Wire protocol between `assh -server PATH` and its clients (asshc), over a
+// unix domain stream socket.  One request per connection:
+//
+//   client:  RUN <absolute path>\n             run a script the server can read
+//            ABC <length>\n<length bytes>      run the enclosed abc payload
+//            QUIT\n                            stop accepting and shut down
+//
+//   server:  O <length>\n<length bytes>        output, as the script writes it
+//            X <exit code>\n                   done; the server closes the socket
+
+#define ASSH_DEFAULT_SOCKET "/tmp/assh.sock"
+
+// A client has this long to send its request line, and then to send each
+// part of an ABC payload, before the server drops it.
+#define ASSH_REQUEST_TIMEOUT_MS 5000
+
+int server_listen( const char *path );
+int server_connect( const char *path );
+
+int read_line( int fd, char *buf, size_t size );
+int read_header( int fd, char *buf, size_t size, size_t *len );
+int set_read_timeout( int fd, int ms );
+int read_all( int fd, char *buf, size_t count );
+int write_all( int fd, const char *buf, size_t count );
+
+int send_output( int fd, const char *bytes, size_t count );
+int send_exit( int fd, int code );
+
+#endif
@@ -1,5 +1,12 @@
 #include <unistd.h>
 #include <getopt.h>
+#include <errno.h>
+#include <math.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <sys/wait.h>
 
 #include <readline/readline.h>
 #include <readline/history.h>
@@ -7,13 +14,68 @@
 #include "shell.h"
 #include "util.h"
 #include "shellcore.h"
+#include "abccache.h"
+#include "mapfile.h"
+#include "compileahead.h"
+#include "gcstats.h"
+#include "profiler.h"
+#include "jitmap.h"
+#include "cpupin.h"
+#include "jobsource.h"
+#include "bench.h"
 
 using namespace avmplus;
 using namespace avmshell;
 
-ShellCore* repl_core;
+AsshCore* repl_core;
+AsshSettings assh_settings;
+
+AsshSettings::AsshSettings()
+    : work_stealing(false)
+    , prefork(false)
+    , prefork_pipe(NULL)
+    , server_path(NULL)
+    , evals(NULL)
+    , numevals(0)
+    , batch(false)
+    , batch_delim('\n')
+    , flush(FLUSH_AUTO)
+    , outbuf_size(OUTPUT_DEFAULT_SIZE)
+    , ordered_output(false)
+    , reuse_pools(false)
+    , compile_ahead(0)
+    , gcstats(false)
+    , gcstats_dump(NULL)
+    , heap_soft(0)
+    , heap_hard(0)
+    , recycle_jobs(0)
+    , recycle_heap(0)
+    , recycle_frag(0)
+    , elastic_min(0)
+    , elastic_max(0)
+    , elastic_idle_ms(2000)
+    , sticky(true)
+    , pin_cpus(NULL)
+    , num_pin_cpus(0)
+    , job_source(NULL)
+    , bench_dir(NULL)
+    , bench_compare(NULL)
+    , bench_modes((char *)"mixed,interp,jit")
+    , bench_workers((char *)"1")
+    , bench_runs(3)
+    , bench_out(NULL)
+    , bench_threshold(5.0)
+    , dispatch_samples(NULL)
+    , max_dispatch_samples(0)
+    , profile_path(NULL)
+    , profile_hz(Profiler::kDefaultHz)
+    , perf_map(false)
+    , perf_jitdump(false)
+{
+}
 
 int run_shell( int argc, char **argv ) {
+    int exitCode = 0;
 	gc_init();
 	
     {
@@ -21,22 +83,86 @@ int run_shell( int argc, char **argv ) {
         
         ShellSettings settings;
         parse_args( argc, argv, settings );
-        single_worker(settings);
+        output_init( assh_settings.flush, assh_settings.outbuf_size );
+        if ( assh_settings.bench_dir )
+            exitCode = bench_suite( argv[0] );
+        else if ( assh_settings.bench_compare )
+            exitCode = bench_compare( assh_settings.bench_compare, settings.filenames[0] );
+        else if ( settings.numworkers > 1 || settings.numthreads > 1 || assh_settings.server_path || assh_settings.elastic_max ||
+             assh_settings.job_source ) {
+            if ( multi_worker(settings) > 0 )
+                exitCode = 1;
+        }
+        else
+            single_worker(settings);
+        
+        if ( settings.do_log ) {
+            abc_cache_report();
+            map_report();
+            compile_ahead_report();
+            job_source_report();
+            if ( assh_settings.perf_map )
+                JitMap::report( stderr );
+        }
+        if ( assh_settings.gcstats )
+            GCStats::report( stderr, assh_settings.gcstats_dump, settings );
+        if ( assh_settings.profile_path )
+            Profiler::report( assh_settings.profile_path );
     }
 	
 	gc_end();
-    return 0;
+    return exitCode;
 }
 
-void parse_args( int argc, char **argv, ShellSettings settings ) {
+void parse_args( int argc, char **argv, ShellSettings &settings ) {
     static struct option opts[] =
     {
         { "repl", no_argument, NULL, 'r' },
-        { "eval", required_argument, NULL, 'e' }
+        { "eval", required_argument, NULL, 'e' },
+        { "workers", required_argument, NULL, 'w' },
+        { "scheduler", required_argument, NULL, 's' },
+        { "log", no_argument, NULL, 'l' },
+        { "prefork", no_argument, NULL, 'p' },
+        { "prefork-pipe", required_argument, NULL, 'P' },
+        { "server", required_argument, NULL, 'S' },
+        { "stdin-batch", optional_argument, NULL, 'b' },
+        { "flush", required_argument, NULL, 'f' },
+        { "outbuf", required_argument, NULL, 'o' },
+        { "ordered", no_argument, NULL, 'O' },
+        { "abc-cache", required_argument, NULL, 'C' },
+        { "reuse-pools", no_argument, NULL, 'R' },
+        { "compile-ahead", required_argument, NULL, 'A' },
+        { "gcstats", optional_argument, NULL, 'G' },
+        { "Dgcthreshold", required_argument, NULL, 'T' },
+        { "gcstack", required_argument, NULL, 'K' },
+        { "worker-heap", required_argument, NULL, 'H' },
+        { "recycle", required_argument, NULL, 'Y' },
+        { "elastic", required_argument, NULL, 'E' },
+        { "affinity", required_argument, NULL, 'a' },
+        { "cpus", required_argument, NULL, 'c' },
+        { "jobs", required_argument, NULL, 'J' },
+        { "Dinterp", no_argument, NULL, 'I' },
+        { "Ojit", no_argument, NULL, 'X' },
+        { "osr", required_argument, NULL, 'Z' },
+        { "bench", required_argument, NULL, 'B' },
+        { "bench-compare", required_argument, NULL, 'M' },
+        { "bench-modes", required_argument, NULL, 'm' },
+        { "bench-workers", required_argument, NULL, 'W' },
+        { "bench-runs", required_argument, NULL, 'n' },
+        { "bench-out", required_argument, NULL, 'U' },
+        { "bench-threshold", required_argument, NULL, 't' },
+        { "profile", required_argument, NULL, 'F' },
+        { "profile-hz", required_argument, NULL, 'z' },
+        { "perf-map", optional_argument, NULL, 'L' },
+        { "Dverifyall", no_argument, NULL, 'V' },
+        { "Dverifyonly", no_argument, NULL, 'v' },
+        { "Dverifyquiet", no_argument, NULL, 'q' },
+        { NULL, 0, NULL, 0 }
     };
     
+    // _only: accept avmshell-style single-dash long options (-workers, -log).
     int c, i;
-    while ( (c = getopt_long( argc, argv, "r::e:", opts, &i )) != -1 ) {
+    while ( (c = getopt_long_only( argc, argv, "r::e:w:", opts, &i )) != -1 ) {
         switch (c)
         {
             case 'r':
@@ -44,8 +170,263 @@ void parse_args( int argc, char **argv, ShellSettings settings ) {
                 break;
                 
             case 'e':
-                printf( "-e not supported yet.\n" );
+                if ( !assh_settings.evals )
+                    assh_settings.evals = new char*[argc];
+                assh_settings.evals[assh_settings.numevals++] = optarg;
+                settings.do_repl = false;
+                break;
+                
+            case 'b':
+                if ( optarg && eq( optarg, "nul" ) )
+                    assh_settings.batch_delim = '\0';
+                else if ( optarg ) {
+                    printf( "bad value to -stdin-batch: %s (nul, or nothing for newlines)\n", optarg );
+                    exit(-1);
+                }
+                assh_settings.batch = true;
+                settings.do_repl = false;
+                break;
+                
+            case 'w':
+                parse_workers( optarg, settings );
+                settings.do_repl = false;
+                if ( settings.repeats > 1 )
+                    assh_settings.reuse_pools = true;
+                break;
+                
+            case 's':
+                if ( eq( optarg, "master" ) )
+                    assh_settings.work_stealing = false;
+                else if ( eq( optarg, "steal" ) )
+                    assh_settings.work_stealing = true;
+                else {
+                    printf( "bad value to --scheduler: %s (master or steal)\n", optarg );
+                    exit(-1);
+                }
+                break;
+                
+            case 'l':
+                settings.do_log = true;
+                break;
+                
+            case 'V':
+                settings.verifyall = true;
+                settings.verifyquiet = false;
+                break;
+                
+            case 'v':
+                settings.verifyall = true;
+                settings.verifyonly = true;
+                settings.verifyquiet = false;
+                break;
+                
+            case 'q':
+                settings.verifyall = true;
+                settings.verifyonly = true;
+                settings.verifyquiet = true;
+                break;
+                
+            case 'R':
+                assh_settings.reuse_pools = true;
+                break;
+                
+            case 'A': {
+                char *end;
+                assh_settings.compile_ahead = strtol( optarg, &end, 10 );
+                if ( *end || assh_settings.compile_ahead < 1 ) {
+                    printf( "bad value to -compile-ahead: %s\n", optarg );
+                    exit(-1);
+                }
+                break;
+            }
+                
+            case 'G':
+                assh_settings.gcstats = true;
+                assh_settings.gcstats_dump = optarg;
+                break;
+                
+            case 'T':
+            case 'K': {
+                char *end;
+                long val = strtol( optarg, &end, 10 );
+                if ( *end || val < 0 ) {
+                    printf( "bad value to %s: %s\n", c == 'T' ? "-Dgcthreshold" : "-gcstack", optarg );
+                    exit(-1);
+                }
+                if ( c == 'T' )
+                    settings.gcthreshold = uint32_t(val);
+                else
+                    settings.markstackAllowance = int32_t(val);
+                break;
+            }
+                
+            case 'H':
+                parse_heap_budget( optarg, settings );
+                break;
+                
+            case 'Y':
+                parse_recycle( optarg );
+                break;
+                
+            case 'a':
+                if ( eq( optarg, "sticky" ) )
+                    assh_settings.sticky = true;
+                else if ( eq( optarg, "none" ) )
+                    assh_settings.sticky = false;
+                else {
+                    printf( "bad value to -affinity: %s (sticky or none)\n", optarg );
+                    exit(-1);
+                }
+                break;
+                
+            case 'c':
+                assh_settings.num_pin_cpus = parse_cpu_list( optarg, &assh_settings.pin_cpus );
+                if ( assh_settings.num_pin_cpus == 0 ) {
+                    printf( "bad value to -cpus: %s (e.g. 0,2,4-7)\n", optarg );
+                    exit(-1);
+                }
+                break;
+                
+            case 'E':
+                parse_elastic( optarg );
+                settings.do_repl = false;
+                break;
+                
+            case 'C':
+                abc_cache_init( optarg );
+                break;
+                
+            case 'O':
+                assh_settings.ordered_output = true;
+                break;
+                
+            case 'f':
+                if ( eq( optarg, "line" ) )
+                    assh_settings.flush = FLUSH_LINE;
+                else if ( eq( optarg, "block" ) )
+                    assh_settings.flush = FLUSH_BLOCK;
+                else {
+                    printf( "bad value to -flush: %s (line or block)\n", optarg );
+                    exit(-1);
+                }
+                break;
+                
+            case 'o': {
+                char *end;
+                assh_settings.outbuf_size = strtoul( optarg, &end, 10 );
+                if ( *end || assh_settings.outbuf_size == 0 ) {
+                    printf( "bad value to -outbuf: %s\n", optarg );
+                    exit(-1);
+                }
+                break;
+            }
+                
+            case 'I':
+                settings.runmode = avmplus::RM_interp_all;
+                break;
+                
+            case 'X':
+#ifdef VMCFG_NANOJIT
+                settings.runmode = avmplus::RM_jit_all;
+                break;
+#else
+                printf( "-Ojit: no JIT in this build\n" );
                 exit(-1);
+#endif
+                
+            case 'Z': {
+#ifdef VMCFG_OSR
+                char *end;
+                long val = strtol( optarg, &end, 10 );
+                if ( *end || val < 0 ) {
+                    printf( "bad value to -osr: %s\n", optarg );
+                    exit(-1);
+                }
+                settings.osr_threshold = int32_t(val);
+                break;
+#else
+                printf( "-osr: no OSR in this build\n" );
+                exit(-1);
+#endif
+            }
+                
+            case 'B':
+                assh_settings.bench_dir = optarg;
+                settings.do_repl = false;
+                break;
+                
+            case 'M':
+                assh_settings.bench_compare = optarg;
+                settings.do_repl = false;
+                break;
+                
+            case 'm':
+                assh_settings.bench_modes = optarg;
+                break;
+                
+            case 'W':
+                assh_settings.bench_workers = optarg;
+                break;
+                
+            case 'n':
+            case 't': {
+                char *end;
+                double val = strtod( optarg, &end );
+                if ( *end || val < ( c == 'n' ? 1 : 0 ) ) {
+                    printf( "bad value to %s: %s\n", c == 'n' ? "-bench-runs" : "-bench-threshold", optarg );
+                    exit(-1);
+                }
+                if ( c == 'n' )
+                    assh_settings.bench_runs = int(val);
+                else
+                    assh_settings.bench_threshold = val;
+                break;
+            }
+                
+            case 'U':
+                assh_settings.bench_out = optarg;
+                break;
+                
+            case 'F':
+                assh_settings.profile_path = optarg;
+                settings.interrupts = true;
+                break;
+                
+            case 'z': {
+                char *end;
+                assh_settings.profile_hz = strtol( optarg, &end, 10 );
+                if ( *end || assh_settings.profile_hz < 1 || assh_settings.profile_hz > 1000 ) {
+                    printf( "bad value to -profile-hz: %s (1 to 1000)\n", optarg );
+                    exit(-1);
+                }
+                break;
+            }
+                
+            case 'L':
+                if ( optarg && !eq( optarg, "jitdump" ) ) {
+                    printf( "bad value to -perf-map: %s (jitdump, or nothing for the map alone)\n", optarg );
+                    exit(-1);
+                }
+                assh_settings.perf_map = true;
+                assh_settings.perf_jitdump = optarg != NULL;
+                break;
+                
+            case 'J':
+                assh_settings.job_source = optarg;
+                settings.do_repl = false;
+                break;
+                
+            case 'S':
+                assh_settings.server_path = optarg;
+                settings.do_repl = false;
+                break;
+                
+            case 'P':
+                assh_settings.prefork_pipe = optarg;
+                // fall through
+            case 'p':
+                assh_settings.prefork = true;
+                settings.do_repl = false;
                 break;
                 
             default:
@@ -59,6 +440,146 @@ void parse_args( int argc, char **argv, ShellSettings settings ) {
         settings.filenames = &argv[optind];
         settings.numfiles  =  argc-optind ;
     }
+    
+    // -Dverifyonly with -w: the files are jobs like any others, verified
+    // in parallel, one file to a core; report in file order, so the
+    // diagnostics don't depend on which thread finished first.  One large
+    // abc still verifies on one core.
+    if ( settings.verifyonly && ( settings.numworkers > 1 || settings.numthreads > 1 ) )
+        assh_settings.ordered_output = true;
+    
+    // -elastic starts from its minimum, plus any cores -w asked for beyond it.
+    if ( assh_settings.elastic_max ) {
+        if ( assh_settings.work_stealing || assh_settings.prefork ) {
+            printf( "-elastic uses the master scheduler.\n" );
+            exit(-1);
+        }
+        settings.numthreads = assh_settings.elastic_min;
+        if ( settings.numworkers < settings.numthreads )
+            settings.numworkers = settings.numthreads;
+    }
+    
+    if ( assh_settings.perf_map && !JitMap::init( assh_settings.perf_jitdump ) )
+        exit(1);
+    
+    if ( assh_settings.bench_dir || assh_settings.bench_compare ) {
+        // each benchmark runs in an assh of its own, so this one only drives.
+        if ( assh_settings.bench_compare ? settings.numfiles != 1 : settings.numfiles != 0 ) {
+            printf( "-bench DIR takes no input files; -bench-compare BASE takes the results to compare.\n" );
+            exit(-1);
+        }
+        return;
+    }
+    
+    if ( assh_settings.server_path ) {
+        // requests arrive at any time, so only the master can dispatch them.
+        if ( assh_settings.work_stealing || settings.numfiles > 0 ) {
+            printf( "-server takes no input files and uses the master scheduler.\n" );
+            exit(-1);
+        }
+        // clients that hang up early must not take the server with them.
+        signal( SIGPIPE, SIG_IGN );
+    }
+    else if ( assh_settings.job_source ) {
+        // jobs arrive at any time, so only the master can dispatch them.
+        if ( assh_settings.work_stealing || assh_settings.prefork || settings.numfiles > 0 ) {
+            printf( "-jobs takes no input files and uses the master scheduler.\n" );
+            exit(-1);
+        }
+        if ( !job_source_open( assh_settings.job_source ) )
+            exit(1);
+    }
+    else if ( ( settings.numworkers > 1 || settings.numthreads > 1 || assh_settings.elastic_max ) && settings.numfiles <= 0 ) {
+        printf( "-w and -elastic require input files.\n" );
+        exit(-1);
+    }
+}
+
+// -w N,M[,R]: N cores on M threads, every file run R times.
+// Same rules as avmshell's -workers.
+void parse_workers( const char *val, ShellSettings &settings ) {
+    int nchar;
+    if ( sscanf( val, "%d,%d,%d%n", &settings.numworkers, &settings.numthreads, &settings.repeats, &nchar ) != 3 )
+        if ( sscanf( val, "%d,%d%n", &settings.numworkers, &settings.numthreads, &nchar ) != 2 ) {
+            printf( "bad value to -w: %s\n", val );
+            exit(-1);
+        }
+    
+    if ( settings.numthreads < 1 ||
+         settings.numworkers < settings.numthreads ||
+         settings.repeats < 1 ||
+         size_t(nchar) != strlen(val) ) {
+        printf( "bad value to -w: %s\n", val );
+        exit(-1);
+    }
+}
+
+// -worker-heap SOFT[,HARD]: per-core heap budgets in MB, on top of what
+// the core holds after setup.  Over SOFT live after a collection, or HARD
+// in use at any time, the job is aborted and its core replaced.  Aborting
+// a job relies on interrupt checks in the running code.
+void parse_heap_budget( const char *val, ShellSettings &settings ) {
+    unsigned long soft, hard = 0;
+    int nchar;
+    if ( ( sscanf( val, "%lu,%lu%n", &soft, &hard, &nchar ) != 2 &&
+           sscanf( val, "%lu%n", &soft, &nchar ) != 1 ) ||
+         size_t(nchar) != strlen(val) || ( soft == 0 && hard == 0 ) || ( hard != 0 && hard < soft ) ) {
+        printf( "bad value to -worker-heap: %s (SOFT[,HARD] in MB)\n", val );
+        exit(-1);
+    }
+    
+    assh_settings.heap_soft = size_t(soft) << 20;
+    assh_settings.heap_hard = size_t(hard) << 20;
+    settings.interrupts = true;
+}
+
+// -recycle jobs=N,heap=MB,frag=PCT (any of them): rebuild a worker core
+// after N jobs, once its GC heap passes MB, or once more than PCT percent
+// of the blocks its GC holds are free.  Rebuilding happens on a thread of
+// its own, so dispatch carries on with the other cores; give the pool
+// more cores than threads to keep every thread busy meanwhile.
+void parse_recycle( const char *val ) {
+    char *copy = strdup( val ), *save = NULL;
+    
+    for ( char *item = strtok_r( copy, ",", &save ) ; item ; item = strtok_r( NULL, ",", &save ) ) {
+        char *eq_sign = strchr( item, '=' ), *end;
+        long n = eq_sign ? strtol( eq_sign + 1, &end, 10 ) : 0;
+        if ( !eq_sign || *end || eq_sign[1] == 0 || n <= 0 ) {
+            printf( "bad value to -recycle: %s (jobs=N,heap=MB,frag=PCT)\n", val );
+            exit(-1);
+        }
+        *eq_sign = 0;
+        if ( eq( item, "jobs" ) )
+            assh_settings.recycle_jobs = int(n);
+        else if ( eq( item, "heap" ) )
+            assh_settings.recycle_heap = size_t(n) << 20;
+        else if ( eq( item, "frag" ) && n < 100 )
+            assh_settings.recycle_frag = int(n);
+        else {
+            printf( "bad value to -recycle: %s (jobs=N,heap=MB,frag=PCT)\n", val );
+            exit(-1);
+        }
+    }
+    
+    free( copy );
+}
+
+// -elastic MIN,MAX[,IDLE_MS]: start the worker pool with MIN threads and
+// cores; while a job waits for one, add a thread and a core of its own, up
+// to MAX threads; retire a thread and a free core once the thread has had
+// nothing to do for IDLE_MS (2000 by default), down to MIN again.
+void parse_elastic( const char *val ) {
+    int min, max, idle = assh_settings.elastic_idle_ms, nchar;
+    if ( ( sscanf( val, "%d,%d,%d%n", &min, &max, &idle, &nchar ) != 3 &&
+           sscanf( val, "%d,%d%n", &min, &max, &nchar ) != 2 ) ||
+         size_t(nchar) != strlen(val) || min < 1 || max < min || idle < 1 ) {
+        printf( "bad value to -elastic: %s (MIN,MAX[,IDLE_MS])\n", val );
+        exit(-1);
+    }
+    
+    assh_settings.elastic_min = min;
+    assh_settings.elastic_max = max;
+    assh_settings.elastic_idle_ms = idle;
 }
 
 void gc_init() {
@@ -87,14 +608,15 @@ void single_worker( ShellSettings settings )
     MMgc::GC *gc = mmfx_new( MMgc::GC(MMgc::GCHeap::GetGCHeap(), gcconfig) );
     {
         MMGC_GCENTER(gc);
-        repl_core = new ShellCoreImpl( gc, settings, true );
+        repl_core = new AsshCore( gc, settings, true );
+        repl_core->reusePools = assh_settings.reuse_pools;
         single_worker_helper( repl_core, settings );
         delete repl_core;
     }
     mmfx_delete( gc );
 }
 
-void single_worker_helper( ShellCore *shell, ShellSettings &settings )
+void single_worker_helper( AsshCore *shell, ShellSettings &settings )
 {
 	if (!shell->setup(settings))
         exit(1);
@@ -110,17 +632,218 @@ void single_worker_helper( ShellCore *shell, ShellSettings &settings )
     if (settings.do_testSWFHasAS3 && settings.numfiles != 1)
         exit(1);
     
+    if (assh_settings.prefork) {
+        prefork_worker( shell, settings );
+        return;
+    }
+    
+    if ( assh_settings.compile_ahead > 0 && settings.numfiles > 1 )
+        compile_ahead_start( settings, assh_settings.compile_ahead );
+    
     // execute each abc file
     for (int i=0 ; i < settings.numfiles ; i++ ) {
-        int exitCode = shell->evaluateFile(settings, settings.filenames[i]);
-        if (exitCode != 0)
+        int exitCode;
+        uint8_t *abc;
+        uint32_t abclen;
+        char *cached;
+        if ( compile_ahead_take( i, &abc, &abclen, &cached ) ) {
+            shell->beginEval();
+            exitCode = abc ? shell->runAbc( abc, abclen ) : shell->runFile( settings, cached );
+            shell->endEval();
+            free( abc );
+            free( cached );
+        }
+        else
+            exitCode = evaluate_file( shell, settings, settings.filenames[i] );
+        if (exitCode != 0) {
+            // The compile threads allocate from the shared GCHeap.
+            compile_ahead_stop();
             exit(exitCode);
+        }
     }
     
+    compile_ahead_stop();
+    
+    for (int i=0 ; i < assh_settings.numevals ; i++ )
+        eval_string( assh_settings.evals[i] );
+    
+    if (assh_settings.batch)
+        run_batch( shell );
+    
     if (settings.do_repl)
         run_repl();
 }
 
+#define BATCH_BUFFER_SIZE (1 << 20)
+
+// -stdin-batch: evaluate a stream of programs from stdin, each ending in
+// batch_delim.  No prompt, no history, no readline: input comes in large
+// blocks and each program is compiled straight out of the read buffer.
+// A program longer than the buffer grows it.
+void run_batch( AsshCore *shell )
+{
+    const char delim = assh_settings.batch_delim;
+    size_t size = BATCH_BUFFER_SIZE;
+    size_t have = 0;
+    char *buf = (char *)malloc( size );
+    unsigned long evals = 0;
+    uint64_t start = VMPI_getPerformanceCounter();
+    
+    for (bool eof = false; !eof; ) {
+        if ( have == size ) {
+            size *= 2;
+            buf = (char *)realloc( buf, size );
+        }
+        
+        ssize_t n = read( 0, buf + have, size - have );
+        if ( n < 0 ) {
+            if ( errno == EINTR )
+                continue;
+            perror( "stdin" );
+            break;
+        }
+        if ( n == 0 )
+            eof = true;
+        have += n;
+        
+        char *p = buf, *end = buf + have;
+        for (;;) {
+            char *q = (char *)memchr( p, delim, end - p );
+            if ( !q ) {
+                // the last program needn't be terminated.
+                if ( !eof || p == end )
+                    break;
+                q = end;
+            }
+            if ( q > p ) {
+                eval_program( shell, p, q - p );
+                evals++;
+            }
+            p = q < end ? q + 1 : end;
+        }
+        
+        have = end - p;
+        memmove( buf, p, have );
+    }
+    
+    free( buf );
+    
+    double secs = double(VMPI_getPerformanceCounter() - start) / double(VMPI_getPerformanceFrequency());
+    fprintf( stderr, "batch: %lu evals in %.3f s (%.0f evals/s)\n",
+             evals, secs, secs > 0 ? evals / secs : 0.0 );
+}
+
+// Zygote mode: the core set up above is never run; every script gets a
+// copy-on-write fork() of it instead, so a job starts with the builtins
+// already initialized and whatever it does dies with the child.
+void prefork_worker( AsshCore *shell, ShellSettings &settings )
+{
+    int jobs = 0;
+    uint64_t spawn_ticks = 0;
+    
+    // files named on the command line behave like single_worker: stop at
+    // the first one that fails.
+    for ( int i=0 ; i < settings.numfiles ; i++ ) {
+        int exitCode = prefork_run( shell, settings, settings.filenames[i], spawn_ticks );
+        jobs++;
+        if ( exitCode != 0 )
+            exit( exitCode );
+    }
+    
+    // then serve the control pipe, one script path per line, until ".quit".
+    // a failing job is reported but does not take the zygote down.
+    if ( assh_settings.prefork_pipe ) {
+        bool use_stdin = eq( assh_settings.prefork_pipe, "-" );
+        char path[PATH_MAX];
+        
+        for (bool quit = false; !quit; ) {
+            FILE *pipe = use_stdin ? stdin : fopen( assh_settings.prefork_pipe, "r" );
+            if ( !pipe ) {
+                perror( assh_settings.prefork_pipe );
+                exit(1);
+            }
+            
+            while ( fgets( path, sizeof(path), pipe ) ) {
+                path[strcspn( path, "\r\n" )] = 0;
+                if ( !*path )
+                    continue;
+                if ( eq( path, ".quit" ) ) {
+                    quit = true;
+                    break;
+                }
+                
+                int exitCode = prefork_run( shell, settings, path, spawn_ticks );
+                jobs++;
+                if ( exitCode != 0 )
+                    fprintf( stderr, "%s: exit code %d\n", path, exitCode );
+            }
+            
+            // stdin is done at EOF; a fifo just lost its last writer, so
+            // reopen it and wait for the next one.
+            if ( use_stdin )
+                break;
+            fclose( pipe );
+        }
+    }
+    
+    if ( settings.do_log && jobs > 0 )
+        fprintf( stderr, "prefork: %d jobs, %.1f us average fork\n", jobs,
+                 double(spawn_ticks) * 1e6 / double(VMPI_getPerformanceFrequency()) / jobs );
+}
+
+// Run one script in a child of the zygote and return its exit code.
+int prefork_run( AsshCore *shell, ShellSettings &settings, const char *filename, uint64_t &spawn_ticks )
+{
+    // anything still buffered would be written again by the child.
+    output_flush();
+    fflush( stdout );
+    fflush( stderr );
+    
+    uint64_t start = VMPI_getPerformanceCounter();
+    pid_t pid = fork();
+    spawn_ticks += VMPI_getPerformanceCounter() - start;
+    
+    if ( pid < 0 ) {
+        perror( "fork" );
+        return 1;
+    }
+    
+    if ( pid == 0 ) {
+        int exitCode = evaluate_file( shell, settings, filename );
+        output_flush();
+        fflush( stdout );
+        fflush( stderr );
+        // skip the teardown; the parent still owns the pristine core.
+        // Its -gcstats counts die with the child, unreported.
+        _exit( exitCode );
+    }
+    
+    int status;
+    while ( waitpid( pid, &status, 0 ) < 0 )
+        if ( errno != EINTR ) {
+            perror( "waitpid" );
+            return 1;
+        }
+    
+    if ( WIFEXITED(status) )
+        return WEXITSTATUS(status);
+    
+    fprintf( stderr, "%s: killed by signal %d\n", filename, WTERMSIG(status) );
+    return 128 + WTERMSIG(status);
+}
+
+// Every script file the shell runs goes through here.
+int evaluate_file( AsshCore *shell, ShellSettings &settings, const char *filename )
+{
+    char cached[PATH_MAX];
+    if ( abc_cache_lookup( shell, filename, cached, sizeof(cached) ) )
+        filename = cached;
+    shell->beginEval();
+    int exitCode = shell->runFile( settings, filename );
+    shell->endEval();
+    return exitCode;
+}
+
 static int repl_should_run = 1;
 void run_repl() {
 	char* line;
@@ -140,6 +863,230 @@ void run_repl() {
 void setup_readline() {
     rl_readline_name = "assh";
     rl_attempted_completion_function = readline_complete;
+    rl_event_hook = idle_gc;
+}
+
+// Idle-time GC.  readline calls idle_gc every 100 ms or so while it waits
+// for a key; each call does up to IDLE_GC_SLICE_MS of incremental marking
+// and sweeping, so a pause that would land in the next eval is paid for
+// while the user is thinking.  Once a cycle finishes, idle GC rests until
+// the heap has grown by IDLE_GC_GROWTH since.
+#define IDLE_GC_SLICE_MS 5
+#define IDLE_GC_GROWTH   1.1
+
+static size_t   idle_gc_floor = 0;     // bytes in use after the last idle cycle
+static uint64_t idle_gc_ticks = 0;
+static unsigned long idle_gc_slices = 0;
+static unsigned long idle_gc_cycles = 0;
+
+int idle_gc() {
+    MMgc::GC *gc = repl_core->GetGC();
+    
+    if ( !gc->IncrementalMarking() && gc->GetBytesInUse() <= idle_gc_floor )
+        return 0;
+    
+    uint64_t start = VMPI_getPerformanceCounter();
+    uint64_t slice = VMPI_getPerformanceFrequency() * IDLE_GC_SLICE_MS / 1000;
+    do {
+        gc->CollectionWork();
+    } while ( gc->IncrementalMarking() && VMPI_getPerformanceCounter() - start < slice );
+    
+    idle_gc_ticks += VMPI_getPerformanceCounter() - start;
+    idle_gc_slices++;
+    if ( !gc->IncrementalMarking() ) {
+        idle_gc_cycles++;
+        idle_gc_floor = size_t( gc->GetBytesInUse() * IDLE_GC_GROWTH );
+    }
+    return 0;
+}
+
+void print_gc_stats() {
+    MMgc::GC *gc = repl_core->GetGC();
+    
+    printf( "heap: %lu KB in use%s\n", (unsigned long)( gc->GetBytesInUse() / 1024 ),
+            gc->IncrementalMarking() ? ", marking" : "" );
+    if ( repl_core->gcstats )
+        repl_core->gcstats->print( stdout );
+    printf( "idle gc: %lu slices, %lu cycles finished, %.2f ms\n", idle_gc_slices, idle_gc_cycles,
+            double(idle_gc_ticks) * 1000.0 / double(VMPI_getPerformanceFrequency()) );
+}
+
+// .bench [-n N] [-warmup W] [-runmodes] code
+//
+// Compiles code once, as the body of a function, and calls it W times and
+// then N times more, timing each of the N calls.  With -runmodes the code
+// is compiled and timed once interpreted and once jitted, for comparison.
+#define BENCH_DEFAULT_RUNS   1000
+#define BENCH_DEFAULT_WARMUP 100
+#define BENCH_MAX_RUNS       10000000
+
+static const char bench_function[] = "__assh_bench";
+static const char bench_prefix[] = "function __assh_bench():void {\n";
+static const char bench_suffix[] = "\n}\n";
+
+// Through the same buffer as the benchmarked code's output, so what its
+// first call printed comes out first.
+static void bench_printf( const char *format, ... ) {
+    char line[512];
+    va_list args;
+    va_start( args, format );
+    int len = vsnprintf( line, sizeof(line), format, args );
+    va_end( args );
+    if ( len > 0 )
+        output_write( line, len < (int)sizeof(line) ? len : sizeof(line) - 1 );
+}
+
+static void run_bench( const char *label, const uint8_t *abc, uint32_t abclen, int warmup, int n ) {
+    uint64_t *ticks = new uint64_t[n];
+    if ( repl_core->bench( abc, abclen, bench_function, warmup, n, ticks ) )
+        print_bench( label, ticks, n );
+    delete [] ticks;
+}
+
+void bench_command( char *args ) {
+    long n = BENCH_DEFAULT_RUNS, warmup = BENCH_DEFAULT_WARMUP;
+    bool runmodes = false;
+    char *p = args;
+    
+    for (;;) {
+        while ( *p == ' ' )
+            p++;
+        if ( strncmp( p, "-n ", 3 ) == 0 )
+            n = strtol( p + 3, &p, 10 );
+        else if ( strncmp( p, "-warmup ", 8 ) == 0 )
+            warmup = strtol( p + 8, &p, 10 );
+        else if ( strncmp( p, "-runmodes", 9 ) == 0 && ( p[9] == ' ' || p[9] == 0 ) ) {
+            runmodes = true;
+            p += 9;
+        }
+        else
+            break;
+    }
+    if ( *p == 0 || n < 1 || n > BENCH_MAX_RUNS || warmup < 0 || warmup > BENCH_MAX_RUNS ) {
+        bench_printf( "usage: .bench [-n N] [-warmup W] [-runmodes] code (N, W up to %d)\n", BENCH_MAX_RUNS );
+        return;
+    }
+    
+    size_t len = strlen( bench_prefix ) + strlen( p ) + strlen( bench_suffix );
+    char *src = new char[len + 1];
+    sprintf( src, "%s%s%s", bench_prefix, p, bench_suffix );
+    
+    uint8_t *abc;
+    uint32_t abclen;
+    if ( !abc_compile_string( repl_core, "bench", src, len, &abc, &abclen ) ) {
+        // Let the compiler say why.
+        repl_core->evaluateString( repl_core->newStringLatin1( src ), false );
+        delete [] src;
+        return;
+    }
+    delete [] src;
+    
+    if ( runmodes ) {
+#ifdef VMCFG_NANOJIT
+        // Each mode parses a pool of its own, so nothing compiled under
+        // one carries over to the other.
+        avmplus::Runmode saved = repl_core->config.runmode;
+        repl_core->config.runmode = avmplus::RM_interp_all;
+        run_bench( "interp", abc, abclen, warmup, n );
+        repl_core->config.runmode = avmplus::RM_jit_all;
+        run_bench( "jit", abc, abclen, warmup, n );
+        repl_core->config.runmode = saved;
+#else
+        bench_printf( ".bench: no JIT in this build, -runmodes ignored\n" );
+        run_bench( "interp", abc, abclen, warmup, n );
+#endif
+    }
+    else
+        run_bench( "", abc, abclen, warmup, n );
+    
+    free( abc );
+}
+
+// .profile [-hz N] [-o FILE] code
+//
+// Evaluates code with a profiler of its own attached to the REPL core and
+// prints the most sampled stacks, or writes them all to FILE in folded
+// form.  Interrupt checks are turned on while code is compiled and back
+// off afterwards; functions the REPL compiled without them are only seen
+// when they call something that has them.
+#define PROFILE_TOP_STACKS 20
+
+void profile_command( char *args ) {
+    int hz = assh_settings.profile_hz;
+    const char *out = NULL;
+    char *p = args;
+    
+    for (;;) {
+        while ( *p == ' ' )
+            p++;
+        if ( strncmp( p, "-hz ", 4 ) == 0 )
+            hz = strtol( p + 4, &p, 10 );
+        else if ( strncmp( p, "-o ", 3 ) == 0 ) {
+            for ( p += 3 ; *p == ' ' ; p++ )
+                ;
+            out = p;
+            p += strcspn( p, " " );
+            if ( *p )
+                *p++ = 0;
+        }
+        else
+            break;
+    }
+    if ( *p == 0 || hz < 1 || hz > 1000 || ( out && *out == 0 ) ) {
+        printf( "usage: .profile [-hz N] [-o FILE] code\n" );
+        return;
+    }
+    
+    bool interrupts = repl_core->config.interrupts;
+    repl_core->config.interrupts = true;
+    Profiler *saved = repl_core->profiler;
+    Profiler *profiler = new Profiler( repl_core, hz );
+    repl_core->profiler = profiler;
+    eval_string( p );
+    repl_core->profiler = saved;
+    repl_core->config.interrupts = interrupts;
+    
+    output_flush();
+    printf( "%d samples\n", profiler->samples() );
+    if ( out ) {
+        FILE *f = fopen( out, "w" );
+        if ( f ) {
+            profiler->print( f, 0 );
+            fclose( f );
+        }
+        else
+            perror( out );
+    }
+    else
+        profiler->print( stdout, PROFILE_TOP_STACKS );
+    delete profiler;
+}
+
+static int compare_ticks( const void *a, const void *b ) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// Summarizes n run times in counter ticks; sorts ticks.
+void print_bench( const char *label, uint64_t *ticks, int n ) {
+    double us = 1000000.0 / double(VMPI_getPerformanceFrequency());
+    double sum = 0, sumsq = 0;
+    
+    qsort( ticks, n, sizeof(uint64_t), compare_ticks );
+    for ( int i = 0; i < n; i++ ) {
+        double t = double(ticks[i]) * us;
+        sum += t;
+        sumsq += t * t;
+    }
+    double mean = sum / n;
+    double var = sumsq / n - mean * mean;
+    
+    size_t count = n;
+    bench_printf( "%s%s%d runs: min %.3f us, median %.3f, p90 %.3f, p99 %.3f, max %.3f; mean %.3f, stddev %.3f; %.0f ops/sec\n",
+                  label, *label ? ": " : "", n,
+                  double(ticks[0]) * us, double(ticks[count / 2]) * us,
+                  double(ticks[count * 90 / 100]) * us, double(ticks[count * 99 / 100]) * us, double(ticks[count - 1]) * us,
+                  mean, sqrt( var > 0 ? var : 0 ), sum > 0 ? n * 1000000.0 / sum : 0.0 );
 }
 
 char **readline_complete( const char *text, int start, int end )
@@ -188,6 +1135,8 @@ char *get_input() {
 		line_read = (char *)NULL;
 	}
 	
+	// whatever the last eval printed goes out before the prompt.
+	output_flush();
 	line_read = readline( get_term_prompt() );
 	
 	if ( line_read && *line_read ) {
@@ -210,6 +1159,15 @@ void handle_input(char* line) {
 	else if ( eq( line, ".quit" ) ) {
 		repl_should_run = 0;
 	}
+	else if ( eq( line, ".gc" ) ) {
+		print_gc_stats();
+	}
+	else if ( strncmp( line, ".bench", 6 ) == 0 && ( line[6] == ' ' || line[6] == 0 ) ) {
+		bench_command( line + 6 );
+	}
+	else if ( strncmp( line, ".profile", 8 ) == 0 && ( line[8] == ' ' || line[8] == 0 ) ) {
+		profile_command( line + 8 );
+	}
 	else {
 		eval_string( line );
 	}
@@ -232,8 +1190,16 @@ void print_strings() {
 
 void eval_string( char* str ) {
     avmplus::String* input;
+    repl_core->beginEval();
     input = repl_core->newStringLatin1( str );
     repl_core->evaluateString( input, false );
+    repl_core->endEval();
+}
+
+void eval_program( AsshCore *shell, const char *src, size_t len ) {
+    shell->beginEval();
+    shell->evaluateString( shell->newStringLatin1( src, int(len) ), false );
+    shell->endEval();
 }
 
 void print_help() {
@@ -244,13 +1210,35 @@ avmshell::Platform* avmshell::Platform::GetInstance() {
 	return (avmshell::Platform *)NULL;
 }
 
+static pthread_key_t  thread_output_key;
+static pthread_once_t thread_output_once = PTHREAD_ONCE_INIT;
+
+static void thread_output_init() {
+    pthread_key_create( &thread_output_key, NULL );
+}
+
+// Redirect console output written on the calling thread; NULL restores stdout.
+void set_thread_output( OutputSink *sink ) {
+    pthread_once( &thread_output_once, thread_output_init );
+    pthread_setspecific( thread_output_key, sink );
+}
+
+OutputSink *get_thread_output() {
+    pthread_once( &thread_output_once, thread_output_init );
+    return (OutputSink *)pthread_getspecific( thread_output_key );
+}
+
 void avmshell::ConsoleOutputStream::write(const char* utf8)
 {
-	printf( "%s", utf8 );
+	writeN( utf8, strlen( utf8 ) );
 }
 
 void avmshell::ConsoleOutputStream::writeN(const char* utf8, size_t count)
 {
-	printf( "%s", utf8 );
+	OutputSink *sink = get_thread_output();
+	if ( sink )
+		sink->write( utf8, count );
+	else
+		output_write( utf8, count );
 }
 
@@ -3,15 +3,88 @@
 
 #include "avmshell.h"
 #include "eval.h"
+#include "output.h"
+#include "asshcore.h"
 
 using namespace avmshell;
 using namespace avmplus;
 
+// assh options that have no home in avmshell::ShellSettings.
+struct AsshSettings
+{
+    AsshSettings();
+
+    bool work_stealing;     // -workers: per-thread job deques instead of master dispatch
+    bool prefork;           // fork a warm core for every script
+    char *prefork_pipe;     // ... and keep reading script paths from here ("-" is stdin)
+    char *server_path;      // serve requests on this unix socket from the worker pool
+    char **evals;           // -e expressions, in command line order
+    int numevals;
+    bool batch;             // evaluate programs streamed on stdin
+    char batch_delim;       // ... each ending with this ('\n', or '\0' for -stdin-batch=nul)
+    FlushPolicy flush;      // console output buffering
+    size_t outbuf_size;     // ... and the buffer size
+    bool ordered_output;    // -workers: write each job's output in input order, not completion order
+    bool reuse_pools;       // rerun a core's parsed pool for a file it has run before (on with repeats > 1)
+    int compile_ahead;      // background threads compiling the input files ahead of the main core
+    bool gcstats;           // report what the collectors did at exit (not counting -prefork children)
+    char *gcstats_dump;     // ... and write it as JSON here
+    size_t heap_soft;       // -workers: bytes a core's jobs may keep live before the job is aborted and the core replaced
+    size_t heap_hard;       // ... or have in use at all, garbage included
+    int recycle_jobs;       // -workers: rebuild a core after this many jobs,
+    size_t recycle_heap;    // ... or once its heap is past this many bytes,
+    int recycle_frag;       // ... or more than this percentage of it is free
+    int elastic_min;        // -workers: grow the pool from this many threads and cores
+    int elastic_max;        // ... up to this many threads while jobs wait (0: fixed pool)
+    int elastic_idle_ms;    // ... and shrink it by threads idle for this long
+    bool sticky;            // -workers: run a core on the thread it last ran on when that thread is free
+    int *pin_cpus;          // -workers: pin thread i to pin_cpus[i % num_pin_cpus]
+    int num_pin_cpus;
+    char *job_source;       // -workers: run the script paths streamed from here, not the input files
+    char *bench_dir;        // run the benchmark suite in this directory instead (see bench.h)
+    char *bench_compare;    // ... or compare the input file's results against these
+    char *bench_modes;      // runmodes to run the suite in
+    char *bench_workers;    // ... and worker counts
+    int bench_runs;         // best of this many runs
+    char *bench_out;        // write the results here rather than to stdout
+    double bench_threshold; // percent worse than the baseline that fails a comparison
+    uint64_t *dispatch_samples; // -workers: master to slave handover times, in counter ticks, for asshbench
+    int max_dispatch_samples;
+    char *profile_path;     // sample the AS3 stacks of every core and write them here, folded, at exit
+    int profile_hz;         // ... this many times a second (also .profile's default)
+    bool perf_map;          // write where the JIT put each method to /tmp/perf-<pid>.map
+    bool perf_jitdump;      // ... and jitdump records to /tmp/jit-<pid>.dump
+};
+
+// Somewhere other than stdout for ConsoleOutputStream to send what is
+// written on one thread, e.g. a -server client.
+class OutputSink
+{
+public:
+    virtual ~OutputSink() {}
+    virtual void write( const char *bytes, size_t count ) = 0;
+};
+
+extern AsshSettings assh_settings;
+extern AsshCore *repl_core;     // The core -repl, -e and single_worker run on
+
 int   run_shell( int argc, char **argv );
 void  run_repl();
-void  parse_args( int argc, char **argv, ShellSettings settings );
+void  run_batch( AsshCore *shell );
+void  parse_args( int argc, char **argv, ShellSettings &settings );
+void  parse_workers( const char *val, ShellSettings &settings );
+void  parse_heap_budget( const char *val, ShellSettings &settings );
+void  parse_recycle( const char *val );
+void  parse_elastic( const char *val );
 void  single_worker( ShellSettings settings );
-void  single_worker_helper( ShellCore *shell, ShellSettings &settings );
+void  single_worker_helper( AsshCore *shell, ShellSettings &settings );
+int   evaluate_file( AsshCore *shell, ShellSettings &settings, const char *filename );
+int   multi_worker( ShellSettings &settings );
+void  prefork_worker( AsshCore *shell, ShellSettings &settings );
+int   prefork_run( AsshCore *shell, ShellSettings &settings, const char *filename, uint64_t &spawn_ticks );
+
+void        set_thread_output( OutputSink *sink );
+OutputSink *get_thread_output();
 
 void  gc_init();
 void  gc_end();
@@ -20,8 +93,14 @@ char *get_input();
 char *get_term_prompt();
 void  handle_input( char* line );
 void  eval_string( char* str );
+void  eval_program( AsshCore *shell, const char *src, size_t len );
 
 void   setup_readline();
+int    idle_gc();
+void   print_gc_stats();
+void   bench_command( char *args );
+void   print_bench( const char *label, uint64_t *ticks, int n );
+void   profile_command( char *args );
 char **readline_complete( const char *text, int start, int end );
 char  *command_generator( const char *text, int state );
 
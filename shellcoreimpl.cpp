@@ -38,10 +38,23 @@
  * ***** END LICENSE BLOCK ***** */
 
 #include "avmshell.h"
+#include "shell.h"
+#include "server.h"
+#include "cpupin.h"
+#include "jobsource.h"
+#include "samples.h"
 #ifdef VMCFG_NANOJIT
 #include "../nanojit/nanojit.h"
 #endif
 #include <float.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 
 #include "extensions-tracers.hh"
 #include "avmshell-tracers.hh"
@@ -664,17 +677,88 @@ namespace avmshell
     
     struct MultiworkerState;
     
+    // Collects the console output of the job a core is running, so that it
+    // reaches stdout as one block when the job finishes instead of
+    // interleaving with other cores' output on the shared stream.
+    class CaptureBuffer : public OutputSink
+    {
+    public:
+        CaptureBuffer()
+        : bytes(NULL)
+        , count(0)
+        , capacity(0)
+        {
+        }
+        
+        ~CaptureBuffer()
+        {
+            free(bytes);
+        }
+        
+        virtual void write(const char* p, size_t n)
+        {
+            if (count + n > capacity) {
+                capacity = capacity == 0 ? 4096 : capacity;
+                while (count + n > capacity)
+                    capacity *= 2;
+                bytes = (char*)realloc(bytes, capacity);
+            }
+            VMPI_memcpy(bytes + count, p, n);
+            count += n;
+        }
+        
+        // Hand the captured bytes (malloc'd) to the caller and start over.
+        char* detach(size_t* n)
+        {
+            char* p = bytes;
+            *n = count;
+            bytes = NULL;
+            count = 0;
+            capacity = 0;
+            return p;
+        }
+        
+        char*               bytes;
+        size_t              count;
+        size_t              capacity;
+    };
+    
+    // The output of a finished job that has to wait for earlier jobs'
+    // output to be written first (-ordered).
+    struct OutputBlock
+    {
+        int                 seq;
+        char*               bytes;
+        size_t              count;
+        OutputBlock*        next;
+    };
+    
+    // Why a core is retired and rebuilt after a job (-recycle, -worker-heap).
+    enum RecycleReason { kKeepCore, kOverBudget, kJobLimit, kHeapLimit, kFragmented, kNumRecycleReasons };
+    
     struct CoreNode
     {
-        CoreNode(ShellCore* core, int id)
-        : core(core)
+        CoreNode(int id)
+        : core(NULL)
         , id(id)
         , next(NULL)
+        , jobs(0)
+        , setup_bytes(0)
+        , last_thread(-1)
+        , migrations(0)
         {
         }
         
         ~CoreNode()
         {
+            destroyCore();
+        }
+        
+        void destroyCore()
+        {
+            if (core == NULL)
+                return;     // Retired, and not rebuilt at shutdown
+            
             // Destruction order matters.
             MMgc::GC* gc = core->GetGC();
             {
@@ -687,11 +771,185 @@ namespace avmshell
             
             
             delete gc;
+            core = NULL;
         }
         
-        ShellCore * const   core;
+        AsshCore *          core;
         const int           id;
-        CoreNode *          next;       // For the LRU list of available cores
+        CoreNode *          next;       // For the LRU list of available cores, or the owning thread's ring when stealing
+        CaptureBuffer       capture;    // Output of the job running on this core
+        int                 jobs;       // Run since the core was built
+        size_t              setup_bytes;    // GC heap in use when setup() returned
+        int                 last_thread;    // The thread it last ran on, or that built it; -1 after the recycler
+        int                 migrations;     // Jobs run on a thread other than last_thread
+    };
+    
+    // A unit of work for the work-stealing scheduler.
+    struct Job
+    {
+        const char*         filename;
+        int                 seq;        // Position in the job stream: repeat * numfiles + file index
+    };
+    
+    // Per-thread job queue for the work-stealing scheduler.  The owning
+    // thread pops from the head and idle peers steal from the tail.  Every
+    // deque has its own lock, so two threads only contend when a thief and
+    // the owner pick the same deque; there is no global lock and no master.
+    struct JobDeque
+    {
+        JobDeque()
+        : jobs(NULL)
+        , capacity(0)
+        , head(0)
+        , count(0)
+        {
+        }
+        
+        ~JobDeque()
+        {
+            delete [] jobs;
+        }
+        
+        void push(const Job& job)
+        {
+            SCOPE_LOCK(lock) {
+                if (count == capacity)
+                    grow();
+                jobs[(head + count) % capacity] = job;
+                count++;
+            }
+        }
+        
+        // Called by the owner.
+        bool pop(Job* job)
+        {
+            bool found = false;
+            SCOPE_LOCK(lock) {
+                if (count > 0) {
+                    *job = jobs[head];
+                    head = (head + 1) % capacity;
+                    count--;
+                    found = true;
+                }
+            }
+            return found;
+        }
+        
+        // Called by any other thread.
+        bool steal(Job* job)
+        {
+            bool found = false;
+            SCOPE_LOCK(lock) {
+                if (count > 0) {
+                    count--;
+                    *job = jobs[(head + count) % capacity];
+                    found = true;
+                }
+            }
+            return found;
+        }
+        
+    private:
+        // Must hold lock.
+        void grow()
+        {
+            int newcapacity = capacity == 0 ? 16 : capacity * 2;
+            Job* newjobs = new Job[newcapacity];
+            for ( int i=0 ; i < count ; i++ )
+                newjobs[i] = jobs[(head + i) % capacity];
+            delete [] jobs;
+            jobs = newjobs;
+            capacity = newcapacity;
+            head = 0;
+        }
+        
+        vmbase::RecursiveMutex lock;
+        Job*                jobs;
+        int                 capacity;
+        int                 head;
+        int                 count;
+    };
+    
+    // A -server client connection.  The master reads the request line and
+    // hands the connection to a slave, which reads any payload, runs the
+    // request with the console redirected here, and reports the exit code.
+    class ServerRequest : public OutputSink
+    {
+    public:
+        ServerRequest(int fd, const char* header)
+        : fd(fd)
+        , quit(false)
+        , payload(NULL)
+        , payloadLen(0)
+        , broken(false)
+        {
+            filename[0] = 0;
+            VMPI_strncpy(this->header, header, sizeof(this->header));
+            this->header[sizeof(this->header)-1] = 0;
+        }
+        
+        ~ServerRequest()
+        {
+            VMPI_free(payload);
+            close(fd);
+        }
+        
+        // Returns false if the client sent something we can't run, or
+        // stalled sending a payload.
+        bool read()
+        {
+            if (!VMPI_strcmp(header, "QUIT")) {
+                quit = true;
+                return true;
+            }
+            if (!VMPI_strncmp(header, "RUN ", 4)) {
+                VMPI_strncpy(filename, header+4, sizeof(filename));
+                filename[sizeof(filename)-1] = 0;
+                return true;
+            }
+            if (!VMPI_strncmp(header, "ABC ", 4))
+                return readPayload(VMPI_strtol(header+4, 0, 10));
+            return false;
+        }
+        
+        virtual void write(const char* bytes, size_t count)
+        {
+            // If the client went away, let the script finish quietly.
+            if (!broken && send_output(fd, bytes, count) < 0)
+                broken = true;
+        }
+        
+        void finish(int exitCode)
+        {
+            if (!broken)
+                send_exit(fd, exitCode);
+        }
+        
+        const int   fd;
+        bool        quit;
+        char        filename[PATH_MAX];     // RUN
+        uint8_t*    payload;                // ABC
+        size_t      payloadLen;
+        
+        static const size_t kMaxHeader = PATH_MAX + 16;
+        static const long kMaxPayload = 256L << 20;
+        
+    private:
+        // Payloads are run from memory with runAbc, which copies them; a
+        // file would stay mapped, and so on disk, as long as the core.
+        bool readPayload(long count)
+        {
+            if (count <= 0 || count > kMaxPayload)
+                return false;
+            payload = (uint8_t*)VMPI_alloc(size_t(count));
+            if (payload == NULL)
+                return false;
+            payloadLen = size_t(count);
+            return read_all(fd, (char*)payload, payloadLen) == 0;
+        }
+        
+        char        header[kMaxHeader];
+        bool        broken;
     };
     
     struct ThreadNode
@@ -702,21 +960,21 @@ namespace avmshell
         , pendingWork(false)
         , corenode(NULL)
         , filename(NULL)
+        , seq(0)
+        , request(NULL)
         , next(NULL)
+        , own_cores(NULL)
+        , steals(0)
+        , core_slot(-1)
+        , idle_since(0)
+        , retired(false)
+        , exited(false)
         {
         }
         
         // Called from master, which should not be holding
         // thread_monitor but may hold global_monitor
-        void startWork(CoreNode* corenode, const char* filename)
-        {
-            SCOPE_LOCK_NAMED(locker, thread_monitor) {
-                this->corenode = corenode;
-                this->filename = filename;
-                this->pendingWork = true;
-                locker.notify();
-            }
-        }
+        void startWork(CoreNode* corenode, const char* filename, int seq = 0, ServerRequest* request = NULL);
         
         vmbase::WaitNotifyMonitor thread_monitor;
         MultiworkerState& state;
@@ -725,9 +983,31 @@ namespace avmshell
         bool pendingWork;
         CoreNode* corenode;         // The core running (or about to run, or just finished running) on this thread
         const char* filename;       // The work given to that core
+        uint64_t dispatched;        // When the master handed it over
+        int seq;                    // ... and its position in the job stream
+        ServerRequest* request;     // ... or the -server client to read it from
         ThreadNode * next;          // For the LRU list of available threads
+        
+        // Work-stealing scheduler only; touched by other threads only through deque.
+        JobDeque deque;             // Jobs queued for this thread
+        CoreNode* own_cores;        // Ring of cores this thread runs its jobs on, next one first
+        int steals;                 // Jobs taken from peers' deques
+        
+        // Elastic pool only; under global_monitor.
+        int core_slot;              // A thread added while running builds its one core here
+        uint64_t idle_since;        // When it last went on the free list
+        bool retired;               // Retired while idle; exits without being told
+        bool exited;                // ... and has destroyed its core
+    };
+    
+    struct PoolSample
+    {
+        double              ms;         // Since setup started
+        int                 threads;
     };
     
+    static const int kMaxPoolSamples = 256;
+    
     struct MultiworkerState
     {
         MultiworkerState(ShellSettings& settings)
@@ -739,7 +1019,46 @@ namespace avmshell
         , free_cores(NULL)
         , free_cores_last(NULL)
         , num_free_threads(0)
+        , stealing(assh_settings.work_stealing)
+        , threads(NULL)
+        , cores(NULL)
+        , cores_ready(0)
+        , setup_start(0)
+        , setup_end(0)
+        , ordered(assh_settings.ordered_output)
+        , next_seq(0)
+        , held_output(NULL)
+        , failures(0)
+        , dispatches_seen(0)
+        , dispatch_ticks(0)
+        , dispatch_max(0)
+        , timing_dispatch(settings.do_log || assh_settings.dispatch_samples != NULL)
+        , recycling(assh_settings.heap_soft || assh_settings.heap_hard || assh_settings.recycle_jobs ||
+                    assh_settings.recycle_heap || assh_settings.recycle_frag)
+        , retired(NULL)
+        , recycler_done(false)
+        , sticky(assh_settings.sticky)
+        , dispatches(0)
+        , migrations(0)
+        , pinned(0)
+        , elastic(assh_settings.elastic_max > 0)
+        , min_threads(settings.numthreads)
+        , max_threads(elastic ? assh_settings.elastic_max : settings.numthreads)
+        , max_cores(settings.numworkers + max_threads - min_threads)
+        , idle_ticks(VMPI_getPerformanceFrequency() * assh_settings.elastic_idle_ms / 1000)
+        , growing(false)
+        , graveyard(NULL)
+        , peak_threads(settings.numthreads)
         {
+            wake_fds[0] = wake_fds[1] = -1;
+            for ( int i=0 ; i < kNumRecycleReasons ; i++ )
+                recycled[i] = 0;
+            gcconfig.collectionThreshold = settings.gcthreshold;
+            gcconfig.exactTracing = settings.exactgc;
+            gcconfig.markstackAllowance = settings.markstackAllowance;
+            gcconfig.drc = settings.drc;
+            gcconfig.mode = settings.gcMode();
+            gcconfig.validateDRC = settings.drcValidation;
         }
         
         
@@ -748,6 +1067,7 @@ namespace avmshell
         void freeThread(ThreadNode* t)
         {
             SCOPE_LOCK_NAMED(locker, global_monitor) {
+                t->idle_since = VMPI_getPerformanceCounter();
                 
                 if (free_threads_last != NULL)
                     free_threads_last->next = t;
@@ -769,6 +1089,272 @@ namespace avmshell
             }
         }
         
+        // Called from the slave threads as the cores they build come
+        // online, holding neither thread_monitor nor global_monitor.
+        void freeCore(CoreNode* c)
+        {
+            SCOPE_LOCK_NAMED(locker, global_monitor) {
+                if (free_cores_last != NULL)
+                    free_cores_last->next = c;
+                else
+                    free_cores = c;
+                free_cores_last = c;
+                
+                locker.notify();
+            }
+        }
+        
+        // Called from the slave threads when a job finishes, holding
+        // neither thread_monitor nor global_monitor.  Writes the job's
+        // captured output as one block: right away, or with -ordered once
+        // the output of every job before it in the job stream is out.
+        void emitOutput(int seq, CaptureBuffer& capture)
+        {
+            if (!ordered) {
+                output_write(capture.bytes, capture.count);
+                capture.count = 0;
+                return;
+            }
+            
+            SCOPE_LOCK(output_lock) {
+                if (seq != next_seq) {
+                    OutputBlock* block = new OutputBlock;
+                    block->seq = seq;
+                    block->bytes = capture.detach(&block->count);
+                    OutputBlock** p = &held_output;
+                    while (*p != NULL && (*p)->seq < seq)
+                        p = &(*p)->next;
+                    block->next = *p;
+                    *p = block;
+                }
+                else {
+                    output_write(capture.bytes, capture.count);
+                    capture.count = 0;
+                    next_seq++;
+                    while (held_output != NULL && held_output->seq == next_seq) {
+                        OutputBlock* block = held_output;
+                        held_output = block->next;
+                        output_write(block->bytes, block->count);
+                        free(block->bytes);
+                        delete block;
+                        next_seq++;
+                    }
+                }
+            }
+        }
+        
+        // Called from the slave threads when a job exits non-zero.
+        void jobFailed()
+        {
+            SCOPE_LOCK(output_lock) {
+                failures++;
+            }
+        }
+        
+        // Called from the slave threads when a job is done with a core.
+        // Checks go from cheapest to dearest; all are off by default.
+        RecycleReason retireReason(CoreNode* c)
+        {
+            if (!recycling)
+                return kKeepCore;
+            if (c->core->overBudget)
+                return kOverBudget;
+            if (assh_settings.recycle_jobs && c->jobs >= assh_settings.recycle_jobs)
+                return kJobLimit;
+            
+            MMgc::GC* gc = c->core->GetGC();
+            size_t inuse = gc->GetBytesInUse();
+            if (assh_settings.recycle_heap && inuse > assh_settings.recycle_heap)
+                return kHeapLimit;
+            
+            // Fragmentation: the share of the blocks the GC holds that is
+            // not in use.  Small heaps are left alone; they can't get far.
+            size_t held = gc->GetNumBlocks() * MMgc::GCHeap::kBlockSize;
+            if (assh_settings.recycle_frag && held > (1 << 20) && inuse < held &&
+                (held - inuse) * 100 > held * size_t(assh_settings.recycle_frag))
+                return kFragmented;
+            
+            return kKeepCore;
+        }
+        
+        // Called from the slave threads, holding no monitor.  The core is
+        // off the free list until the recycler has rebuilt it.
+        void retireCore(CoreNode* c, RecycleReason why)
+        {
+            SCOPE_LOCK(output_lock) {
+                recycled[why]++;
+            }
+            SCOPE_LOCK_NAMED(locker, recycle_monitor) {
+                c->next = retired;
+                retired = c;
+                locker.notify();
+            }
+        }
+        
+        // Called from the recycler thread; false once it should exit.
+        // Cores still queued at shutdown come out with *rebuild false.
+        bool takeRetired(CoreNode** c, bool* rebuild)
+        {
+            SCOPE_LOCK_NAMED(locker, recycle_monitor) {
+                while (retired == NULL && !recycler_done)
+                    locker.wait();
+                if (retired == NULL)
+                    return false;
+                *c = retired;
+                retired = retired->next;
+                (*c)->next = NULL;
+                *rebuild = !recycler_done;
+            }
+            return true;
+        }
+        
+        void stopRecycler()
+        {
+            SCOPE_LOCK_NAMED(locker, recycle_monitor) {
+                recycler_done = true;
+                locker.notify();
+            }
+        }
+        
+        // Called from a slave thread when it picks up work, holding no
+        // monitor, with the time since the master handed it over; only
+        // when timing_dispatch.
+        void dispatchSeen(uint64_t ticks)
+        {
+            SCOPE_LOCK(output_lock) {
+                if (assh_settings.dispatch_samples != NULL && dispatches_seen < assh_settings.max_dispatch_samples)
+                    assh_settings.dispatch_samples[dispatches_seen] = ticks;
+                dispatches_seen++;
+                dispatch_ticks += ticks;
+                if (ticks > dispatch_max)
+                    dispatch_max = ticks;
+            }
+        }
+        
+        // -server: called from a slave thread that got a QUIT request.
+        void stopServer()
+        {
+            char c = 0;
+            if (::write(wake_fds[1], &c, 1) < 0)
+                perror("stopServer");
+        }
+        
+        // Called from the slave threads once all of their cores are set up.
+        void coresReady(int n)
+        {
+            SCOPE_LOCK_NAMED(locker, global_monitor) {
+                cores_ready += n;
+                if (cores_ready == settings.numworkers)
+                    setup_end = VMPI_getPerformanceCounter();
+                locker.notify();
+            }
+        }
+        
+        // -elastic: called from the master, holding global_monitor, while a
+        // job waits for a thread and core.  Defined after SlaveThread.
+        void grow();
+        
+        // -elastic: called from a slave thread that grew the pool, once its
+        // core is built, holding no monitor.
+        void grown(ThreadNode* t, CoreNode* c)
+        {
+            SCOPE_LOCK_NAMED(locker, global_monitor) {
+                cores[t->core_slot] = c;
+                if (free_cores_last != NULL)
+                    free_cores_last->next = c;
+                else
+                    free_cores = c;
+                free_cores_last = c;
+                growing = false;
+                locker.notify();
+            }
+        }
+        
+        // -elastic: called from an idle slave thread, holding no monitor.
+        // If the pool is above its minimum and t has been waiting for work
+        // long enough, takes t off the free list together with a free core,
+        // and returns the core for t to destroy on its way out.
+        CoreNode* retireIdleThread(ThreadNode* t)
+        {
+            SCOPE_LOCK(global_monitor) {
+                if (numthreads <= min_threads || free_cores == NULL ||
+                    VMPI_getPerformanceCounter() - t->idle_since < idle_ticks)
+                    return NULL;
+                
+                ThreadNode* prev = NULL;
+                ThreadNode** p = &free_threads;
+                while (*p != NULL && *p != t) {
+                    prev = *p;
+                    p = &(*p)->next;
+                }
+                if (*p == NULL)
+                    return NULL;    // The master has just given it work
+                *p = t->next;
+                if (free_threads_last == t)
+                    free_threads_last = prev;
+                t->next = NULL;
+                
+                CoreNode* c = free_cores;
+                free_cores = c->next;
+                if (free_cores == NULL)
+                    free_cores_last = NULL;
+                c->next = NULL;
+                cores[c->id] = NULL;
+                
+                numthreads--;
+                numcores--;
+                num_free_threads--;
+                t->retired = true;
+                samplePool();
+                return c;
+            }
+            return NULL;
+        }
+        
+        // Holding global_monitor.  Every change of size is offered as a
+        // sample.
+        void samplePool()
+        {
+            if (numthreads > peak_threads)
+                peak_threads = numthreads;
+            PoolSample* s = pool_samples.next();
+            if (s == NULL)
+                return;
+            s->ms = double(VMPI_getPerformanceCounter() - setup_start) * 1000.0 / double(VMPI_getPerformanceFrequency());
+            s->threads = numthreads;
+        }
+        
+        // Joins and frees the retired threads that have finished tearing
+        // down their cores, without holding global_monitor while joining.
+        // Those still at it are left for next time.
+        void reapRetired()
+        {
+            if (!elastic)
+                return;
+            
+            ThreadNode* done = NULL;
+            SCOPE_LOCK(global_monitor) {
+                ThreadNode** p = &graveyard;
+                while (*p != NULL) {
+                    ThreadNode* t = *p;
+                    if (t->exited) {
+                        *p = t->next;
+                        t->next = done;
+                        done = t;
+                    }
+                    else
+                        p = &t->next;
+                }
+            }
+            while (done != NULL) {
+                ThreadNode* t = done;
+                done = t->next;
+                t->thread->join();
+                delete t->thread;
+                delete t;
+            }
+        }
+        
         // Called from the master thread, which must already hold global_monitor.
         bool getThreadAndCore(ThreadNode** t, CoreNode** c)
         {
@@ -781,17 +1367,57 @@ namespace avmshell
                 free_threads_last = NULL;
             (*t)->next = NULL;
             
-            *c = free_cores;
-            free_cores = free_cores->next;
-            if (free_cores == NULL)
-                free_cores_last = NULL;
-            (*c)->next = NULL;
+            // The least recently used core, unless sticky and one of the
+            // free cores last ran on this thread: its heap and code may
+            // still be in this CPU's caches.
+            CoreNode* prev = NULL;
+            CoreNode* core = free_cores;
+            if (sticky) {
+                while (core != NULL && core->last_thread != (*t)->id) {
+                    prev = core;
+                    core = core->next;
+                }
+                if (core == NULL) {
+                    prev = NULL;
+                    core = free_cores;
+                }
+            }
+            if (prev != NULL)
+                prev->next = core->next;
+            else
+                free_cores = core->next;
+            if (free_cores_last == core)
+                free_cores_last = prev;
+            core->next = NULL;
+            *c = core;
+            
+            dispatches++;
+            if (core->last_thread >= 0 && core->last_thread != (*t)->id) {
+                migrations++;
+                core->migrations++;
+            }
+            core->last_thread = (*t)->id;
             
             num_free_threads--;
             
             return true;
         }
         
+        // Work-stealing scheduler: called from a slave thread whose own
+        // deque is empty.  Victims are probed round-robin starting with
+        // the thief's right-hand neighbour so thieves spread out.
+        bool steal(ThreadNode* thief, Job* job)
+        {
+            for ( int i=1 ; i < numthreads ; i++ ) {
+                ThreadNode* victim = threads[(thief->id + i) % numthreads];
+                if (victim->deque.steal(job)) {
+                    thief->steals++;
+                    return true;
+                }
+            }
+            return false;
+        }
+        
         vmbase::WaitNotifyMonitor global_monitor;
         ShellSettings&      settings;
         int                 numthreads;
@@ -804,9 +1430,67 @@ namespace avmshell
         CoreNode*           free_cores;
         CoreNode*           free_cores_last;
         int                 num_free_threads;
+        
+        const bool          stealing;   // assh --scheduler=steal
+        ThreadNode**        threads;    // All threads, indexed by id; used by thieves
+        
+        // Cores are built and set up in parallel on the slave threads:
+        // thread t builds cores t, t+numthreads, ...  Each core has its own
+        // GC, so the threads share nothing but the GCHeap while doing it.
+        MMgc::GCConfig      gcconfig;
+        CoreNode**          cores;      // Indexed by id, each slot written once by its builder
+        int                 cores_ready;
+        uint64_t            setup_start;
+        uint64_t            setup_end;  // Set when the last core is ready
+        
+        int                 wake_fds[2];    // -server: written to stop the accept loop
+        
+        // Job output.  Protected by output_lock.
+        const bool          ordered;        // assh -ordered: emit in job stream order
+        vmbase::RecursiveMutex output_lock;
+        int                 next_seq;       // The job whose output is due next
+        OutputBlock*        held_output;    // Finished jobs waiting for it, by seq
+        int                 failures;       // Jobs that exited non-zero, under output_lock
+        int                 dispatches_seen;    // Master to slave handovers timed; likewise
+        uint64_t            dispatch_ticks;     // ... their total latency
+        uint64_t            dispatch_max;       // ... and the longest
+        const bool          timing_dispatch;    // Only for -log and asshbench: it takes output_lock per job
+        int                 recycled[kNumRecycleReasons];   // Cores rebuilt, by reason; likewise
+        
+        // Core recycling.  Retired cores queue here for the recycler
+        // thread, which rebuilds them and puts them back on free_cores.
+        // Protected by recycle_monitor.
+        const bool          recycling;
+        vmbase::WaitNotifyMonitor recycle_monitor;
+        CoreNode*           retired;
+        bool                recycler_done;
+        
+        // Thread-core affinity.  Under global_monitor.
+        const bool          sticky;         // Prefer the core a free thread last ran
+        int                 dispatches;     // Jobs handed out by getThreadAndCore
+        int                 migrations;     // ... on a core that last ran on another thread
+        int                 pinned;         // Threads bound to their -cpus entry
+        
+        // -elastic: while a job waits for a thread and core the pool grows
+        // by one of each, up to max_threads; a thread idle for idle_ticks
+        // retires with a free core, down to min_threads.  With it numthreads
+        // and numcores are the live counts, under global_monitor; threads[]
+        // and cores[] are sized for the maximum and have holes.
+        const bool          elastic;
+        const int           min_threads;
+        const int           max_threads;
+        const int           max_cores;
+        const uint64_t      idle_ticks;
+        bool                growing;        // A new thread is building its core
+        DecimatingSamples<PoolSample, kMaxPoolSamples> pool_samples;
+        ThreadNode*         graveyard;      // Retired threads whose slots were reused, not yet joined
+        int                 peak_threads;
     };
     
     static void masterThread(MultiworkerState& state);
+    static void buildCore(MultiworkerState& state, CoreNode* corenode);
+    static void serverThread(MultiworkerState& state, int listenfd);
+    static void streamThread(MultiworkerState& state);
     
     class SlaveThread : public vmbase::VMThread
     {
@@ -816,85 +1500,98 @@ namespace avmshell
         virtual void run();
         
     private:
+        void buildCores();
+        bool waitElastic();
+        void runStealing();
+        void serve(CoreNode* corenode, ServerRequest* request);
+        void runJob(CoreNode* corenode, const char* filename, int seq);
+        int perform(CoreNode* corenode, const char* filename, const uint8_t* abc = NULL, size_t abclen = 0);
+        
         ThreadNode* self;
         
     };
 
-    /* static */
-    void Shell::multiWorker(ShellSettings& settings)
+    void ThreadNode::startWork(CoreNode* corenode, const char* filename, int seq, ServerRequest* request)
     {
-        AvmAssert(!settings.do_repl && !settings.do_projector && !settings.do_selftest);
-        
-        MultiworkerState    state(settings);
-        const int           numthreads(state.numthreads);
-        const int           numcores(state.numcores);
-        ThreadNode** const  threads(new ThreadNode*[numthreads]);
-        CoreNode** const    cores(new CoreNode*[numcores]);
-        
-        MMgc::GCConfig gcconfig;
-        gcconfig.collectionThreshold = settings.gcthreshold;
-        gcconfig.exactTracing = settings.exactgc;
-        gcconfig.markstackAllowance = settings.markstackAllowance;
-        gcconfig.mode = settings.gcMode();
-        
-        // Going multi-threaded.
-        
-        // Create and start threads.  They add themselves to the free list.
-        for ( int i=0 ; i < numthreads ; i++ )  {
-            threads[i] = new ThreadNode(state, i);
-            threads[i]->thread = new SlaveThread(threads[i]);
-            threads[i]->thread->start();
-        }
-        
-        // Create collectors and cores.
-        // Extra credit: perform setup in parallel on the threads.
-        for ( int i=0 ; i < numcores ; i++ ) {
-            MMgc::GC* gc = new MMgc::GC(MMgc::GCHeap::GetGCHeap(),  gcconfig);
-            MMGC_GCENTER(gc);
-            cores[i] = new CoreNode(new ShellCoreImpl(gc, settings, false), i);
-            if (!cores[i]->core->setup(settings))
-                Platform::GetInstance()->exit(1);
+        SCOPE_LOCK_NAMED(locker, thread_monitor) {
+            this->corenode = corenode;
+            this->filename = filename;
+            this->seq = seq;
+            this->request = request;
+            if (state.timing_dispatch)
+                this->dispatched = VMPI_getPerformanceCounter();
+            this->pendingWork = true;
+            locker.notify();
         }
+    }
+
+    void MultiworkerState::grow()
+    {
+        if (!elastic || growing || numthreads >= max_threads || cores_ready < settings.numworkers)
+            return;
         
-        // Add the cores to the free list.
-        for ( int i=numcores-1 ; i >= 0 ; i-- ) {
-            cores[i]->next = state.free_cores;
-            state.free_cores = cores[i];
-        }
-        state.free_cores_last = cores[numcores-1];
-        
-        // No locks are held by the master at this point
-        masterThread(state);
-        // No locks are held by the master at this point
-        
-        // Some threads may still be computing, so just wait for them
-        SCOPE_LOCK_NAMED(locker, state.global_monitor) {
-            while (state.num_free_threads < numthreads)
-                locker.wait();
+        // A slot never used, or else one whose thread has retired.  That
+        // thread may still be destroying its core, so it isn't joined here,
+        // under global_monitor, but left for reapRetired.
+        int t = 0;
+        while (t < max_threads && threads[t] != NULL)
+            t++;
+        if (t == max_threads) {
+            t = 0;
+            while (!threads[t]->retired)
+                t++;
+            threads[t]->next = graveyard;
+            graveyard = threads[t];
         }
+        int c = 0;
+        while (cores[c] != NULL)
+            c++;
         
-        // Shutdown: feed NULL to all threads to make them exit.
-        for ( int i=0 ; i < numthreads ; i++ )
-            threads[i]->startWork(NULL,NULL);
+        ThreadNode* tn = new ThreadNode(*this, t);
+        tn->core_slot = c;
+        tn->thread = new SlaveThread(tn);
+        threads[t] = tn;
+        numthreads++;
+        numcores++;
+        growing = true;
+        samplePool();
+        LOGGING( avmplus::AvmLog("Growing the pool: T%d with C%d\n", t, c); )
+        tn->thread->start();
+    }
+    
+    // Rebuilds retired cores off the dispatch path, so the master keeps
+    // handing jobs to the other cores meanwhile.
+    class RecyclerThread : public vmbase::VMThread
+    {
+    public:
+        RecyclerThread(MultiworkerState& state) : state(state) {}
         
-        // Wait for all threads to exit.
-        for ( int i=0 ; i < numthreads ; i++ ) {
-            threads[i]->thread->join();
-            LOGGING( avmplus::AvmLog("T%d: joined the main thread\n", i); )
-        }
+        virtual void run();
         
-        // Single threaded again.
+    private:
+        MultiworkerState& state;
+    };
+    
+    void RecyclerThread::run()
+    {
+        MMGC_ENTER_VOID;
         
-        for ( int i=0 ; i < numthreads ; i++ ) {
-            delete threads[i]->thread;
-            delete threads[i];
+        CoreNode* corenode;
+        bool rebuild;
+        while (state.takeRetired(&corenode, &rebuild)) {
+            corenode->destroyCore();
+            if (rebuild) {
+                buildCore(state, corenode);
+                LOGGING( avmplus::AvmLog("R: C%d rebuilt\n", corenode->id); )
+                state.freeCore(corenode);
+            }
         }
-        
-        for ( int i=0 ; i < numcores ; i++ )
-            delete cores[i];
-        
-        delete [] threads;
-        delete [] cores;
+    }
+    
+    /* static */
+    void Shell::multiWorker(ShellSettings& settings)
+    {
+        (void)::multi_worker(settings);
     }
     
     static void masterThread(MultiworkerState& state)
@@ -912,7 +1609,7 @@ namespace avmshell
                     CoreNode* corenode;
                     while (state.getThreadAndCore(&threadnode, &corenode) && !finish) {
                         LOGGING( avmplus::AvmLog("Scheduling %s on T%d with C%d\n", filenames[nextfile], threadnode->id, corenode->id); )
-                        threadnode->startWork(corenode, filenames[nextfile]);
+                        threadnode->startWork(corenode, filenames[nextfile], r * numfiles + nextfile);
                         nextfile++;
                         if (nextfile == numfiles) {
                             r++;
@@ -929,9 +1626,148 @@ namespace avmshell
                     // this for loop to bypass the locker.wait()
                     // statement.
                     if (finish) break;
+                    state.grow();
+                    locker.wait();
+                }
+            }
+        }
+    }
+    
+    // A -server connection whose request line the master is still reading.
+    struct PendingClient
+    {
+        int         fd;
+        size_t      len;
+        uint64_t    deadline;       // In counter ticks
+        char        header[ServerRequest::kMaxHeader];
+    };
+    
+    static const int kMaxPendingClients = 64;
+    
+    static void dropClient(PendingClient& client, const char* msg)
+    {
+        send_output(client.fd, msg, VMPI_strlen(msg));
+        send_exit(client.fd, 2);
+        close(client.fd);
+    }
+    
+    // -server: the master accepts connections, reads each one's request
+    // line, and hands it to the next free thread and core, until a client
+    // sends QUIT.  Request lines are read without blocking, all at once, so
+    // a client that connects and sends nothing only holds a slot here until
+    // ASSH_REQUEST_TIMEOUT_MS, never a thread or a core.  While every thread
+    // is busy, new clients wait in the listen backlog.
+    static void serverThread(MultiworkerState& state, int listenfd)
+    {
+        struct pollfd fds[2 + kMaxPendingClients];
+        PendingClient* pending = new PendingClient[kMaxPendingClients];
+        int numPending = 0;
+        uint64_t timeout = VMPI_getPerformanceFrequency() * ASSH_REQUEST_TIMEOUT_MS / 1000;
+        
+        fds[0].fd = listenfd;
+        fds[1].fd = state.wake_fds[0];
+        fds[1].events = POLLIN;
+        
+        for (;;) {
+            // Stop accepting while the pending slots are full.
+            fds[0].events = numPending < kMaxPendingClients ? POLLIN : 0;
+            uint64_t now = VMPI_getPerformanceCounter(), next = 0;
+            for (int i=0 ; i < numPending ; i++) {
+                fds[2 + i].fd = pending[i].fd;
+                fds[2 + i].events = POLLIN;
+                fds[2 + i].revents = 0;
+                if (next == 0 || pending[i].deadline < next)
+                    next = pending[i].deadline;
+            }
+            int wait = -1;
+            if (numPending > 0)
+                wait = next > now ? int((next - now) * 1000 / VMPI_getPerformanceFrequency()) + 1 : 0;
+            
+            if (poll(fds, nfds_t(2 + numPending), wait) < 0) {
+                if (errno == EINTR)
+                    continue;
+                perror("poll");
+                break;
+            }
+            if (fds[1].revents != 0)
+                break;
+            
+            // Read what has arrived; drop whoever is done, broken or late.
+            now = VMPI_getPerformanceCounter();
+            for (int i=0 ; i < numPending ; ) {
+                PendingClient& client = pending[i];
+                int status = 0;
+                if (fds[2 + i].revents != 0)
+                    status = read_header(client.fd, client.header, sizeof(client.header), &client.len);
+                if (status == 0 && now >= client.deadline) {
+                    dropClient(client, "assh: timed out waiting for the request\n");
+                    status = -2;
+                }
+                else if (status < 0)
+                    dropClient(client, "assh: bad request\n");
+                else if (status == 1) {
+                    // The slave reads any payload with blocking reads, so
+                    // it gets a timeout of its own.
+                    fcntl(client.fd, F_SETFL, fcntl(client.fd, F_GETFL) & ~O_NONBLOCK);
+                    set_read_timeout(client.fd, ASSH_REQUEST_TIMEOUT_MS);
+                    SCOPE_LOCK_NAMED(locker, state.global_monitor) {
+                        ThreadNode* threadnode;
+                        CoreNode* corenode;
+                        while (!state.getThreadAndCore(&threadnode, &corenode)) {
+                            state.grow();
+                            locker.wait();
+                        }
+                        LOGGING( avmplus::AvmLog("Serving client %d on T%d with C%d\n", client.fd, threadnode->id, corenode->id); )
+                        threadnode->startWork(corenode, NULL, 0, new ServerRequest(client.fd, client.header));
+                    }
+                    state.reapRetired();
+                }
+                if (status == 0) {
+                    i++;
+                    continue;
+                }
+                pending[i] = pending[--numPending];
+                fds[2 + i].revents = fds[2 + numPending].revents;
+            }
+            
+            if ((fds[0].revents & POLLIN) == 0)
+                continue;
+            int fd = accept(listenfd, NULL, NULL);
+            if (fd < 0)
+                continue;
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            PendingClient& client = pending[numPending++];
+            client.fd = fd;
+            client.len = 0;
+            client.deadline = now + timeout;
+        }
+        
+        for (int i=0 ; i < numPending ; i++)
+            close(pending[i].fd);
+        delete [] pending;
+    }
+    
+    // -jobs: the master reads script paths from the job source and hands
+    // each one to the next free thread and core, until the stream ends.
+    // The next path is read before waiting for a thread, and no lock is
+    // held while reading, so a slow producer never stalls the pool.
+    static void streamThread(MultiworkerState& state)
+    {
+        int seq = 0;
+        char* filename;
+        
+        while ((filename = job_source_next()) != NULL) {
+            SCOPE_LOCK_NAMED(locker, state.global_monitor) {
+                ThreadNode* threadnode;
+                CoreNode* corenode;
+                while (!state.getThreadAndCore(&threadnode, &corenode)) {
+                    state.grow();
                     locker.wait();
                 }
+                LOGGING( avmplus::AvmLog("Scheduling %s on T%d with C%d\n", filename, threadnode->id, corenode->id); )
+                threadnode->startWork(corenode, filename, seq++);
             }
+            state.reapRetired();
         }
     }
     
@@ -941,6 +1777,25 @@ namespace avmshell
         
         MultiworkerState& state = self->state;
         
+        // Pin before building, so the cores' heaps start out local.
+        if (assh_settings.num_pin_cpus > 0) {
+            int cpu = assh_settings.pin_cpus[self->id % assh_settings.num_pin_cpus];
+            bool ok = pin_thread(cpu);
+            LOGGING( avmplus::AvmLog("T%d: %s CPU %d\n", self->id, ok ? "Pinned to" : "Failed to pin to", cpu); )
+            if (ok) {
+                SCOPE_LOCK(state.global_monitor) {
+                    state.pinned++;
+                }
+            }
+        }
+        
+        buildCores();
+        
+        if (state.stealing) {
+            runStealing();
+            return;
+        }
+        
         for (;;) {
             // Signal that we're ready for more work: add self to the list of free threads
             
@@ -950,7 +1805,11 @@ namespace avmshell
             // filename until we register for more work, so they don't have to be copied out of
             // the thread structure.
             
-            SCOPE_LOCK_NAMED(locker, self->thread_monitor) {
+            if (state.elastic) {
+                if (!waitElastic())
+                    return;
+            }
+            else SCOPE_LOCK_NAMED(locker, self->thread_monitor) {
                 // Don't wait when pendingWork == true,
                 // slave might have been already signalled but it didn't notice because it wasn't waiting yet.
                 while (self->pendingWork == false)
@@ -960,17 +1819,24 @@ namespace avmshell
                 LOGGING( avmplus::AvmLog("T%d: Exiting\n", self->id); )
                 return;
             }
+            if (state.timing_dispatch)
+                state.dispatchSeen(VMPI_getPerformanceCounter() - self->dispatched);
             
-            // Perform work
-            LOGGING( avmplus::AvmLog("T%d: Work starting\n", self->id); )
-            {
-                MMGC_GCENTER(self->corenode->core->GetGC());
-#ifdef _DEBUG
-                self->corenode->core->codeContextThread = VMPI_currentThread();
-#endif
-                self->corenode->core->evaluateFile(state.settings, self->filename); // Ignore the exit code for now
+            if (self->request != NULL)
+                serve(self->corenode, self->request);
+            else
+                runJob(self->corenode, self->filename, self->seq);
+            if (assh_settings.job_source != NULL)
+                free((void*)self->filename);     // Read by streamThread
+            
+            // A retired core goes to the recycler instead of back on the
+            // free list, and this thread is free again right away.
+            RecycleReason why = state.retireReason(self->corenode);
+            if (why != kKeepCore) {
+                LOGGING( avmplus::AvmLog("T%d: Retiring C%d\n", self->id, self->corenode->id); )
+                state.retireCore(self->corenode, why);
+                self->corenode = NULL;
             }
-            LOGGING( avmplus::AvmLog("T%d: Work completed\n", self->id); )
             
             SCOPE_LOCK(self->thread_monitor) {
                 self->pendingWork = false;
@@ -980,4 +1846,384 @@ namespace avmshell
         }
         return;
     }
+    
+    // Build and set up this thread's share of the cores.  With the master
+    // scheduler each core joins the free list as soon as it is ready, so
+    // dispatch starts before the slowest thread is done; with the stealing
+    // scheduler the cores become this thread's ring.
+    void SlaveThread::buildCores()
+    {
+        MultiworkerState& state = self->state;
+        int n = 0;
+        
+        if (self->core_slot >= 0) {
+            CoreNode* corenode = new CoreNode(self->core_slot);
+            buildCore(state, corenode);
+            corenode->last_thread = self->id;
+            LOGGING( avmplus::AvmLog("T%d: C%d set up to grow the pool\n", self->id, corenode->id); )
+            state.grown(self, corenode);
+            return;
+        }
+        
+        // The initial stride: the pool may be growing already.
+        for ( int i=self->id ; i < state.settings.numworkers ; i += state.settings.numthreads ) {
+            CoreNode* corenode = new CoreNode(i);
+            buildCore(state, corenode);
+            corenode->last_thread = self->id;
+            state.cores[i] = corenode;
+            n++;
+            LOGGING( avmplus::AvmLog("T%d: C%d set up\n", self->id, i); )
+            
+            if (state.stealing) {
+                if (self->own_cores == NULL) {
+                    corenode->next = corenode;
+                    self->own_cores = corenode;
+                }
+                else {
+                    corenode->next = self->own_cores->next;
+                    self->own_cores->next = corenode;
+                }
+            }
+            else {
+                state.freeCore(corenode);
+            }
+        }
+        
+        state.coresReady(n);
+    }
+    
+    // -elastic: wait for work like the fixed pool does, but give up now and
+    // then to see whether this thread has been idle long enough to retire.
+    // The check is made without thread_monitor, since the master takes it
+    // while holding global_monitor.  Returns false if the thread retired.
+    bool SlaveThread::waitElastic()
+    {
+        MultiworkerState& state = self->state;
+        const int32_t slice = assh_settings.elastic_idle_ms / 4 + 1;
+        
+        for (;;) {
+            bool ready = false;
+            SCOPE_LOCK_NAMED(locker, self->thread_monitor) {
+                if (self->pendingWork == false)
+                    locker.wait(slice);
+                ready = self->pendingWork;
+            }
+            if (ready)
+                return true;
+            
+            CoreNode* corenode = state.retireIdleThread(self);
+            if (corenode != NULL) {
+                LOGGING( avmplus::AvmLog("T%d: Idle, retiring with C%d\n", self->id, corenode->id); )
+                // The GC's blocks go back to the GCHeap, which decommits
+                // free memory by its own policy.
+                delete corenode;
+                SCOPE_LOCK(state.global_monitor) {
+                    self->exited = true;
+                }
+                return false;
+            }
+        }
+    }
+    
+    // All jobs are queued before the threads start and no job creates more
+    // work, so once our deque and every peer's deque are empty we are done.
+    void SlaveThread::runStealing()
+    {
+        MultiworkerState& state = self->state;
+        Job job;
+        
+        while (self->deque.pop(&job) || state.steal(self, &job)) {
+            CoreNode* corenode = self->own_cores;
+            self->own_cores = corenode->next;
+            
+            self->corenode = corenode;
+            self->filename = job.filename;
+            LOGGING( avmplus::AvmLog("T%d: Job %d (%s) on C%d\n", self->id, job.seq, job.filename, corenode->id); )
+            runJob(corenode, job.filename, job.seq);
+            
+            // The ring is this thread's alone, so the core is rebuilt in
+            // place; the other threads go on stealing meanwhile.
+            RecycleReason why = state.retireReason(corenode);
+            if (why != kKeepCore) {
+                SCOPE_LOCK(state.output_lock) {
+                    state.recycled[why]++;
+                }
+                corenode->destroyCore();
+                buildCore(state, corenode);
+            }
+        }
+        
+        LOGGING( avmplus::AvmLog("T%d: Exiting, %d jobs stolen\n", self->id, self->steals); )
+    }
+    
+    void SlaveThread::serve(CoreNode* corenode, ServerRequest* request)
+    {
+        if (!request->read()) {
+            const char* msg = "assh: bad request\n";
+            request->write(msg, VMPI_strlen(msg));
+            request->finish(2);
+        }
+        else if (request->quit) {
+            self->state.stopServer();
+        }
+        else {
+            set_thread_output(request);
+            request->finish(perform(corenode, request->filename, request->payload, request->payloadLen));
+            set_thread_output(NULL);
+        }
+        
+        delete request;
+        self->request = NULL;
+    }
+    
+    // Give corenode a new core on its own GC, set up and ready to run.
+    static void buildCore(MultiworkerState& state, CoreNode* corenode)
+    {
+        MMgc::GC* gc = new MMgc::GC(MMgc::GCHeap::GetGCHeap(), state.gcconfig);
+        
+        MMGC_GCENTER(gc);
+        corenode->last_thread = -1;
+        corenode->core = new AsshCore(gc, state.settings, false);
+        corenode->core->reusePools = assh_settings.reuse_pools;
+#ifdef _DEBUG
+        corenode->core->codeContextThread = VMPI_currentThread();
+#endif
+        if (!corenode->core->setup(state.settings))
+            Platform::GetInstance()->exit(1);
+        
+        // Each core's builtin pools, methods and strings are objects of
+        // its own GC; tamarin has no way to share them between cores.
+        corenode->setup_bytes = gc->GetBytesInUse();
+        corenode->jobs = 0;
+        
+        // After setup, so the budget only counts what jobs add.
+        corenode->core->setHeapBudget(assh_settings.heap_soft ? corenode->setup_bytes + assh_settings.heap_soft : 0,
+                                      assh_settings.heap_hard ? corenode->setup_bytes + assh_settings.heap_hard : 0);
+    }
+    
+    // Run one job from the job stream, capturing its output on the core.
+    void SlaveThread::runJob(CoreNode* corenode, const char* filename, int seq)
+    {
+        set_thread_output(&corenode->capture);
+        int exitCode = perform(corenode, filename);
+        set_thread_output(NULL);
+        self->state.emitOutput(seq, corenode->capture);
+        if (exitCode != 0)
+            self->state.jobFailed();
+    }
+    
+    // Runs filename, or abc already in memory when given.
+    int SlaveThread::perform(CoreNode* corenode, const char* filename, const uint8_t* abc, size_t abclen)
+    {
+        int exitCode;
+        LOGGING( avmplus::AvmLog("T%d: Work starting\n", self->id); )
+        {
+            MMGC_GCENTER(corenode->core->GetGC());
+#ifdef _DEBUG
+            corenode->core->codeContextThread = VMPI_currentThread();
+#endif
+            if (abc != NULL) {
+                corenode->core->beginEval();
+                exitCode = corenode->core->runAbc(abc, abclen);
+                corenode->core->endEval();
+            }
+            else
+                exitCode = evaluate_file(corenode->core, self->state.settings, filename);
+        }
+        corenode->jobs++;
+        LOGGING( avmplus::AvmLog("T%d: Work completed\n", self->id); )
+        return exitCode;
+    }
+}
+
+// Shell::multiWorker is private to avmshell::Shell, so the pool lives
+// here where run_shell() can reach it.  Returns the number of jobs that
+// exited non-zero.
+int multi_worker( ShellSettings &settings )
+{
+    AvmAssert(!settings.do_repl && !settings.do_projector && !settings.do_selftest);
+    
+    MultiworkerState    state(settings);
+    const int           numthreads(state.numthreads);
+    const int           maxthreads(state.max_threads);  // The same unless -elastic
+    const int           maxcores(state.max_cores);
+    ThreadNode** const  threads(new ThreadNode*[maxthreads]);
+    CoreNode** const    cores(new CoreNode*[maxcores]);
+    int                 listenfd(-1);
+    RecyclerThread*     recycler(NULL);
+    
+    if (assh_settings.server_path) {
+        listenfd = server_listen(assh_settings.server_path);
+        if (listenfd < 0 || pipe(state.wake_fds) < 0)
+            exit(1);
+    }
+    
+    for ( int i=0 ; i < maxthreads ; i++ )
+        threads[i] = NULL;
+    for ( int i=0 ; i < maxcores ; i++ )
+        cores[i] = NULL;
+    state.cores = cores;
+    
+    // Create threads.  Each one builds and sets up its share of the cores
+    // before it takes any work.
+    for ( int i=0 ; i < numthreads ; i++ )  {
+        threads[i] = new ThreadNode(state, i);
+        threads[i]->thread = new SlaveThread(threads[i]);
+    }
+    state.threads = threads;
+    
+    // Going multi-threaded.
+    
+    if (state.stealing) {
+        // Deal jobs out round-robin; the threads own the cores they build,
+        // and jobs move between threads only by stealing.
+        int seq = 0;
+        for ( int r=0 ; r < settings.repeats ; r++ ) {
+            for ( int f=0 ; f < settings.numfiles ; f++ ) {
+                Job job = { settings.filenames[f], seq };
+                threads[seq % numthreads]->deque.push(job);
+                seq++;
+            }
+        }
+        
+        state.setup_start = VMPI_getPerformanceCounter();
+        for ( int i=0 ; i < numthreads ; i++ )
+            threads[i]->thread->start();
+    }
+    else {
+        // The threads add themselves and their cores to the free lists.
+        state.setup_start = VMPI_getPerformanceCounter();
+        for ( int i=0 ; i < numthreads ; i++ )
+            threads[i]->thread->start();
+        if (state.recycling) {
+            recycler = new RecyclerThread(state);
+            recycler->start();
+        }
+        
+        // No locks are held by the master at this point
+        if (listenfd >= 0) {
+            serverThread(state, listenfd);
+            close(listenfd);
+            unlink(assh_settings.server_path);
+        }
+        else if (assh_settings.job_source) {
+            streamThread(state);
+            job_source_close();
+        }
+        else
+            masterThread(state);
+        // No locks are held by the master at this point
+        
+        // Some threads may still be computing, so just wait for them
+        SCOPE_LOCK_NAMED(locker, state.global_monitor) {
+            while (state.num_free_threads < state.numthreads || state.growing)
+                locker.wait();
+        }
+        
+        // Shutdown: feed NULL to all threads to make them exit.  A retired
+        // thread has gone already and ignores it.
+        for ( int i=0 ; i < maxthreads ; i++ )
+            if (threads[i] != NULL)
+                threads[i]->startWork(NULL,NULL);
+    }
+    
+    // Wait for all threads to exit.
+    for ( int i=0 ; i < maxthreads ; i++ ) {
+        if (threads[i] == NULL)
+            continue;
+        threads[i]->thread->join();
+        LOGGING( avmplus::AvmLog("T%d: joined the main thread\n", i); )
+    }
+    while (state.graveyard != NULL) {
+        ThreadNode* t = state.graveyard;
+        state.graveyard = t->next;
+        t->thread->join();
+        delete t->thread;
+        delete t;
+    }
+    if (recycler != NULL) {
+        state.stopRecycler();
+        recycler->join();
+        delete recycler;
+    }
+    
+    // Single threaded again.
+    
+    if (settings.do_log) {
+        avmplus::AvmLog("workers: %d cores set up on %d threads in %.2f ms\n",
+                        settings.numworkers, numthreads,
+                        double(state.setup_end - state.setup_start) * 1000.0 / double(VMPI_getPerformanceFrequency()));
+        if (state.elastic) {
+            avmplus::AvmLog("workers: elastic pool of %d to %d threads, peak %d, %d at exit; threads over time (ms:threads):",
+                            state.min_threads, state.max_threads, state.peak_threads, state.numthreads);
+            for ( int i=0 ; i < state.pool_samples.size() ; i++ )
+                avmplus::AvmLog(" %.0f:%d", state.pool_samples[i].ms, state.pool_samples[i].threads);
+            avmplus::AvmLog("\n");
+        }
+        
+        // The cores alive at exit; with -elastic there are holes.
+        const int numcores = state.numcores;
+        int first = 0;
+        while (first < maxcores && cores[first] == NULL)
+            first++;
+        size_t setup_total = 0, setup_min = first < maxcores ? cores[first]->setup_bytes : 0, setup_max = 0;
+        for ( int i=first ; i < maxcores ; i++ ) {
+            if (cores[i] == NULL)
+                continue;
+            setup_total += cores[i]->setup_bytes;
+            setup_min = cores[i]->setup_bytes < setup_min ? cores[i]->setup_bytes : setup_min;
+            setup_max = cores[i]->setup_bytes > setup_max ? cores[i]->setup_bytes : setup_max;
+        }
+        if (!state.stealing) {
+            int most = 0;
+            for ( int i=0 ; i < maxcores ; i++ )
+                if (cores[i] != NULL && cores[i]->migrations > most)
+                    most = cores[i]->migrations;
+            avmplus::AvmLog("workers: %s dispatch, %d jobs, %d core migrations between threads (%.1f%%), at most %d for one core\n",
+                            state.sticky ? "sticky" : "fifo", state.dispatches, state.migrations,
+                            state.dispatches ? 100.0 * state.migrations / state.dispatches : 0.0, most);
+        }
+        if (state.dispatches_seen > 0)
+            avmplus::AvmLog("workers: master to slave handover %.1f us on average, %.1f us at most\n",
+                            double(state.dispatch_ticks) * 1000000.0 / double(VMPI_getPerformanceFrequency()) / state.dispatches_seen,
+                            double(state.dispatch_max) * 1000000.0 / double(VMPI_getPerformanceFrequency()));
+        if (assh_settings.num_pin_cpus > 0)
+            avmplus::AvmLog("workers: %d of %d threads pinned to CPUs\n", state.pinned, numthreads);
+        if (state.recycling)
+            avmplus::AvmLog("workers: cores rebuilt: %d over budget, %d job limit, %d heap size, %d fragmentation\n",
+                            state.recycled[kOverBudget], state.recycled[kJobLimit],
+                            state.recycled[kHeapLimit], state.recycled[kFragmented]);
+        // Objects in use, per core, which includes setup's garbage until
+        // the first collection; resident memory follows the GCHeap below.
+        if (numcores > 0)
+            avmplus::AvmLog("workers: per-core objects in use after setup %lu KB (min %lu, max %lu); %lu KB for all cores\n",
+                            (unsigned long)(setup_total / numcores / 1024),
+                            (unsigned long)(setup_min / 1024), (unsigned long)(setup_max / 1024),
+                            (unsigned long)(setup_total / 1024));
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+        unsigned long max_rss_kb = (unsigned long)(usage.ru_maxrss / 1024);    // bytes
+#else
+        unsigned long max_rss_kb = (unsigned long)usage.ru_maxrss;             // KB
+#endif
+        avmplus::AvmLog("workers: GCHeap %lu KB committed, process peak resident %lu KB\n",
+                        (unsigned long)(MMgc::GCHeap::GetGCHeap()->GetTotalHeapSize() * MMgc::GCHeap::kBlockSize / 1024),
+                        max_rss_kb);
+    }
+    
+    for ( int i=0 ; i < maxthreads ; i++ ) {
+        if (threads[i] == NULL)
+            continue;
+        delete threads[i]->thread;
+        delete threads[i];
+    }
+    
+    for ( int i=0 ; i < maxcores ; i++ )
+        delete cores[i];
+    
+    delete [] threads;
+    delete [] cores;
+    
+    return state.failures;
 }